@@ -4,6 +4,16 @@
 #include <cmath>
 #include <algorithm>
 #include <string>
+#include <thread>
+#include <functional>
+#include <mutex>
+#include <cstdint>
+#include <unordered_map>
+#include <map>
+#include <atomic>
+#include <cstring>
+#include <iterator>
+#include <array>
 
 using namespace std;
 
@@ -35,6 +45,10 @@ public:
     int getWidth() const { return width; }
     int getHeight() const { return height; }
     int getChannels() const { return channels; }
+    int getMaxVal() const { return maxVal; }
+
+    // Set the maximum sample value (255 for 8-bit, up to 65535 for 16-bit data)
+    void setMaxVal(int value) { maxVal = value; }
 
     // Set number of channels
     void setChannels(int ch) {
@@ -98,8 +112,8 @@ public:
 
         for (int y = 0; y < height; y++) {
             for (int x = 0; x < width; x++) {
-                if (channels == 1) {
-                    // For grayscale images, write the same value for all three channels
+                if (channels < 3) {
+                    // For grayscale images (with or without alpha), write the same value for all three channels
                     int gray = data[y][x][0];
                     file << gray << " " << gray << " " << gray << " ";
                 }
@@ -117,6 +131,103 @@ public:
         return true;
     }
 
+    // Load PAM image (P7 format, any depth; RGB_ALPHA and GRAYSCALE_ALPHA carry an alpha channel)
+    bool loadPAM(const string& filename) {
+        ifstream file(filename, ios::binary);
+        if (!file.is_open()) {
+            cerr << "Error: Could not open file " << filename << endl;
+            return false;
+        }
+
+        string format;
+        file >> format;
+        if (format != "P7") {
+            cerr << "Error: Only P7 PAM format is supported" << endl;
+            return false;
+        }
+
+        int w = 0, h = 0, depth = 0, maxValue = 0;
+        string token;
+        while (file >> token && token != "ENDHDR") {
+            if (token == "WIDTH") file >> w;
+            else if (token == "HEIGHT") file >> h;
+            else if (token == "DEPTH") file >> depth;
+            else if (token == "MAXVAL") file >> maxValue;
+            else getline(file, token); // TUPLTYPE and comments
+        }
+        file.get(); // newline after ENDHDR
+        if (w <= 0 || h <= 0 || depth <= 0 || maxValue <= 0 || maxValue > 65535) {
+            cerr << "Error: Invalid PAM header in " << filename << endl;
+            return false;
+        }
+
+        width = w;
+        height = h;
+        channels = depth;
+        maxVal = maxValue;
+        data.assign(height, vector<vector<int>>(width, vector<int>(channels, 0)));
+
+        // Samples are 1 byte, or 2 bytes big-endian when maxVal exceeds 255
+        int bytesPerSample = maxVal > 255 ? 2 : 1;
+        vector<unsigned char> line(static_cast<size_t>(width) * channels * bytesPerSample);
+        for (int y = 0; y < height; y++) {
+            file.read(reinterpret_cast<char*>(line.data()), line.size());
+            if (!file) {
+                cerr << "Error: Unexpected end of file " << filename << endl;
+                return false;
+            }
+            size_t i = 0;
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < channels; c++) {
+                    if (bytesPerSample == 2) {
+                        data[y][x][c] = line[i] << 8 | line[i + 1];
+                        i += 2;
+                    }
+                    else {
+                        data[y][x][c] = line[i++];
+                    }
+                }
+            }
+        }
+
+        file.close();
+        return true;
+    }
+
+    // Save PAM image (P7 format, all channels)
+    bool savePAM(const string& filename) const {
+        ofstream file(filename, ios::binary);
+        if (!file.is_open()) {
+            cerr << "Error: Could not create file " << filename << endl;
+            return false;
+        }
+
+        const char* tupleTypes[] = { "", "GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA" };
+        file << "P7\nWIDTH " << width << "\nHEIGHT " << height << "\nDEPTH " << channels
+            << "\nMAXVAL " << maxVal << "\n";
+        if (channels >= 1 && channels <= 4) file << "TUPLTYPE " << tupleTypes[channels] << "\n";
+        file << "ENDHDR\n";
+
+        int bytesPerSample = maxVal > 255 ? 2 : 1;
+        vector<unsigned char> line(static_cast<size_t>(width) * channels * bytesPerSample);
+        for (int y = 0; y < height; y++) {
+            size_t i = 0;
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < channels; c++) {
+                    int v = max(0, min(maxVal, data[y][x][c]));
+                    if (bytesPerSample == 2) {
+                        line[i++] = static_cast<unsigned char>(v >> 8);
+                    }
+                    line[i++] = static_cast<unsigned char>(v & 0xFF);
+                }
+            }
+            file.write(reinterpret_cast<const char*>(line.data()), line.size());
+        }
+
+        file.close();
+        return true;
+    }
+
     // Print image data to console (for small images)
     void print() const {
         cout << "Image " << width << "x" << height << " (" << channels << " channels):\n";
@@ -133,12 +244,186 @@ public:
         }
     }
 };
+// Class to represent a binary mask with one bit per pixel
+// Each row is padded to whole 64-bit words so rows can be written independently
+class BitMask {
+private:
+    int width, height, wordsPerRow;
+    vector<uint64_t> bits; // [y * wordsPerRow + x / 64], bit x % 64
+
+public:
+    // Default constructor
+    BitMask() {
+        width = 0;
+        height = 0;
+        wordsPerRow = 0;
+    }
+
+    // Create blank (all clear) mask
+    BitMask(int w, int h) {
+        width = w;
+        height = h;
+        wordsPerRow = (w + 63) / 64;
+        bits.assign(static_cast<size_t>(wordsPerRow) * height, 0);
+    }
+
+    // Get mask dimensions
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    int getWordsPerRow() const { return wordsPerRow; }
+
+    // Bit access
+    bool get(int y, int x) const {
+        return (bits[static_cast<size_t>(y) * wordsPerRow + x / 64] >> (x % 64)) & 1;
+    }
+
+    void set(int y, int x, bool value) {
+        uint64_t& word = bits[static_cast<size_t>(y) * wordsPerRow + x / 64];
+        uint64_t bit = uint64_t(1) << (x % 64);
+        if (value) word |= bit;
+        else word &= ~bit;
+    }
+
+    // Word access for a whole row
+    uint64_t* row(int y) { return &bits[static_cast<size_t>(y) * wordsPerRow]; }
+    const uint64_t* row(int y) const { return &bits[static_cast<size_t>(y) * wordsPerRow]; }
+
+    // Bits of the last word in each row that belong to the image (padding bits are kept clear)
+    uint64_t lastWordMask() const {
+        int used = width % 64;
+        return used == 0 ? ~uint64_t(0) : (uint64_t(1) << used) - 1;
+    }
+
+    // Load PBM mask (P4 binary format); black pixels (1 in the file) become clear bits
+    bool loadPBM(const string& filename) {
+        ifstream file(filename, ios::binary);
+        if (!file.is_open()) {
+            cerr << "Error: Could not open file " << filename << endl;
+            return false;
+        }
+
+        string format;
+        file >> format;
+        if (format != "P4") {
+            cerr << "Error: Only P4 PBM format is supported" << endl;
+            return false;
+        }
+
+        int w = 0, h = 0;
+        file >> w >> h;
+        file.get(); // single whitespace before the raster
+        if (!file || w <= 0 || h <= 0) {
+            cerr << "Error: Invalid PBM header in " << filename << endl;
+            return false;
+        }
+        *this = BitMask(w, h);
+
+        int bytesPerRow = (width + 7) / 8;
+        vector<unsigned char> line(bytesPerRow);
+        for (int y = 0; y < height; y++) {
+            file.read(reinterpret_cast<char*>(line.data()), bytesPerRow);
+            if (!file) {
+                cerr << "Error: Unexpected end of file " << filename << endl;
+                return false;
+            }
+            uint64_t* words = row(y);
+            for (int i = 0; i < bytesPerRow; i++) {
+                // PBM packs the leftmost pixel in the most significant bit
+                words[i / 8] |= uint64_t(reverseBits(static_cast<unsigned char>(~line[i]))) << (8 * (i % 8));
+            }
+            words[wordsPerRow - 1] &= lastWordMask();
+        }
+
+        file.close();
+        return true;
+    }
+
+    // Save PBM mask (P4 binary format); clear bits are written as black
+    bool savePBM(const string& filename) const {
+        ofstream file(filename, ios::binary);
+        if (!file.is_open()) {
+            cerr << "Error: Could not create file " << filename << endl;
+            return false;
+        }
+
+        file << "P4\n" << width << " " << height << "\n";
+
+        int bytesPerRow = (width + 7) / 8;
+        vector<unsigned char> line(bytesPerRow);
+        for (int y = 0; y < height; y++) {
+            const uint64_t* words = row(y);
+            for (int i = 0; i < bytesPerRow; i++) {
+                unsigned char byte = static_cast<unsigned char>(words[i / 8] >> (8 * (i % 8)));
+                line[i] = static_cast<unsigned char>(~reverseBits(byte));
+            }
+            // Padding pixels at the end of the row are written as 0
+            if (width % 8 != 0) {
+                line[bytesPerRow - 1] &= static_cast<unsigned char>(0xFF << (8 - width % 8));
+            }
+            file.write(reinterpret_cast<const char*>(line.data()), bytesPerRow);
+        }
+
+        file.close();
+        return true;
+    }
+
+private:
+    static unsigned char reverseBits(unsigned char b) {
+        b = static_cast<unsigned char>((b & 0xF0) >> 4 | (b & 0x0F) << 4);
+        b = static_cast<unsigned char>((b & 0xCC) >> 2 | (b & 0x33) << 2);
+        b = static_cast<unsigned char>((b & 0xAA) >> 1 | (b & 0x55) << 1);
+        return b;
+    }
+};
+
+// Number of set bits in a 64-bit word
+int popcount64(uint64_t v) {
+    v = v - ((v >> 1) & 0x5555555555555555ULL);
+    v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+    v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return static_cast<int>((v * 0x0101010101010101ULL) >> 56);
+}
+
+// Splits the rows [begin, end) into contiguous bands and runs body(bandBegin, bandEnd)
+// for each band on its own thread. Bands are at least minBand items; small ranges run
+// on the calling thread.
+void parallelFor(int begin, int end, const function<void(int, int)>& body, int minBand = 16) {
+    int total = end - begin;
+    if (total <= 0) return;
+
+    int threads = static_cast<int>(thread::hardware_concurrency());
+    if (threads < 1) threads = 1;
+    threads = min(threads, max(1, total / max(1, minBand)));
+    if (threads == 1) {
+        body(begin, end);
+        return;
+    }
+
+    vector<thread> workers;
+    int band = (total + threads - 1) / threads;
+    for (int start = begin; start < end; start += band) {
+        int stop = min(end, start + band);
+        workers.emplace_back(body, start, stop);
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+// Gives img the requested shape and maxVal, keeping its storage when the shape already matches
+// (decoders call this so that reloading same-size frames does not reallocate)
+void reshapeImage(Image& img, int width, int height, int channels, int maxVal = 255) {
+    if (img.getWidth() != width || img.getHeight() != height || img.getChannels() != channels) {
+        img = Image(width, height, channels);
+    }
+    img.setMaxVal(maxVal);
+}
 
 /**
  * Converts a color image to grayscale
  *
  * Steps:
- * 1. Create a new single-channel image with the same width and height
+ * 1. Create a new single-channel image with the same width, height and maxVal
  * 2. For each pixel in the input image:
  *    - Get the R, G, and B values
  *    - Calculate the grayscale value using the formula:
@@ -150,6 +435,7 @@ Image convertToGrayscale(const Image& input) {
     int height = input.getHeight();
     int width = input.getWidth();
     Image output(width, height, 1); // Single channel for grayscale
+    output.setMaxVal(input.getMaxVal());
 
     for (int y = 0; y < height; y++) {
         for (int x = 0; x < width; x++) {
@@ -225,23 +511,28 @@ Image flipVertical(const Image& input) {
  *
  * Steps:
  * 1. Create a new image with the same dimensions as the input
- * 2. For each pixel and each color channel:
- *    - Add the brightness value to the pixel value
- *    - Clamp the result between 0 and 255
- * 3. Return the adjusted image
+ * 2. Scale the brightness value from 8-bit units to the image's range
+ *    (value * maxVal / 255, so +50 is the same relative change at any bit depth)
+ * 3. For each pixel and each color channel:
+ *    - Add the scaled value to the pixel value
+ *    - Clamp the result between 0 and maxVal (255 for 8-bit images)
+ * 4. Return the adjusted image
  */
 Image adjustBrightness(const Image& input, int value) {
     int height = input.getHeight();
     int width = input.getWidth();
     int channels = input.getChannels();
+    int maxVal = input.getMaxVal();
     Image output(width, height, channels);
+    output.setMaxVal(maxVal);
+    int offset = static_cast<int>(lround(static_cast<double>(value) * maxVal / 255));
 
     for (int y = 0; y < height; y++) {
         for (int x = 0; x < width; x++) {
             for (int c = 0; c < channels; c++) {
-                int new_value = input(y, x, c) + value;
-                // Clamp بين 0 و 255
-                new_value = max(0, min(255, new_value));
+                int new_value = input(y, x, c) + offset;
+                // Clamp بين 0 و maxVal
+                new_value = max(0, min(maxVal, new_value));
                 output(y, x, c) = new_value;
             }
         }
@@ -256,33 +547,31 @@ Image adjustBrightness(const Image& input, int value) {
  * Steps:
  * 1. Create a new image with the same dimensions as the input
  * 2. For each pixel and each color channel:
- *    - Subtract 128 from the pixel value to center around 0
+ *    - Subtract mid = (maxVal + 1) / 2 (128 for 8-bit) to center around 0
  *    - Multiply by the contrast factor
- *    - Add 128 to center back around 128
- *    - Clamp the result between 0 and 255
+ *    - Add mid to center back
+ *    - Clamp the result between 0 and maxVal
  * 3. Return the adjusted image
  */
 Image adjustContrast(const Image& input, float factor) {
     int height = input.getHeight();
     int width = input.getWidth();
     int channels = input.getChannels();
+    int maxVal = input.getMaxVal();
+    float mid = (maxVal + 1) / 2.0f;
     Image output(width, height, channels);
-    for (int x = 0; x < height; x++) {
-        for (int y = 0; y < width; y++) {
+    output.setMaxVal(maxVal);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
             for (int c = 0; c < channels; c++) {
                 float original = input(y, x, c);
-                float adjusted = factor * (original - 128.0f) + 128.0f;
-                adjusted = max(0.0f, min(255.0f, adjusted));
-                output(y, x, c) = adjusted;
+                float adjusted = factor * (original - mid) + mid;
+                adjusted = max(0.0f, min(static_cast<float>(maxVal), adjusted));
+                output(y, x, c) = static_cast<int>(adjusted);
             }
         }
     }
 
-    // TODO: Implement this function
-    // For each pixel and each channel:
-    //   new_value = factor * (input(y, x, c) - 128) + 128
-    //   output(y, x, c) = max(0, min(255, new_value))
-
     return output;
 }
 
@@ -302,6 +591,7 @@ Image applyBlur(const Image& input) {
     int width = input.getWidth();
     int channels = input.getChannels();
     Image output(width, height, channels);
+    output.setMaxVal(input.getMaxVal());
     for (int y = 1; y < height - 1; y++) {
         for (int x = 1; x < width - 1; x++) {
             for (int c = 0; c < channels; c++) {
@@ -363,111 +653,6451 @@ Image rotate90Clockwise(const Image& img) {
 }
 
 
-// Creates a simple 4x4 test image with a pattern
-void createTestImage(const string& filename) {
-    Image img(4, 4);
+// Sobel gradient of a grayscale image, stored as flat row-major arrays
+struct GradientField {
+    int width = 0;
+    int height = 0;
+    vector<float> magnitude;         // [y * width + x]
+    vector<unsigned char> direction; // 0: horizontal, 1: 45 deg, 2: vertical, 3: 135 deg
+};
 
-    // Create a simple 4x4 pattern
-    // Row 0
-    img(0, 0, 0) = 255; img(0, 0, 1) = 0;   img(0, 0, 2) = 0;    // Red
-    img(0, 1, 0) = 0;   img(0, 1, 1) = 255; img(0, 1, 2) = 0;    // Green
-    img(0, 2, 0) = 0;   img(0, 2, 1) = 0;   img(0, 2, 2) = 255;  // Blue
-    img(0, 3, 0) = 255; img(0, 3, 1) = 255; img(0, 3, 2) = 255;  // White
+/**
+ * Computes the Sobel gradient of an image
+ *
+ * Steps:
+ * 1. Convert the input to grayscale if it has more than one channel
+ * 2. For each pixel (borders are clamped to the nearest pixel):
+ *    - gx = (right column) - (left column) with weights 1, 2, 1
+ *    - gy = (bottom row) - (top row) with weights 1, 2, 1
+ *    - magnitude = sqrt(gx^2 + gy^2)
+ *    - direction = gradient angle quantized to one of 4 orientations
+ * 3. Rows are processed in parallel bands
+ */
+GradientField computeGradient(const Image& input) {
+    Image gray = input.getChannels() == 1 ? input : convertToGrayscale(input);
+    int height = gray.getHeight();
+    int width = gray.getWidth();
 
-    // Row 1
-    img(1, 0, 0) = 255; img(1, 0, 1) = 255; img(1, 0, 2) = 0;    // Yellow
-    img(1, 1, 0) = 255; img(1, 1, 1) = 0;   img(1, 1, 2) = 255;  // Magenta
-    img(1, 2, 0) = 0;   img(1, 2, 1) = 255; img(1, 2, 2) = 255;  // Cyan
-    img(1, 3, 0) = 128; img(1, 3, 1) = 128; img(1, 3, 2) = 128;  // Gray
+    GradientField field;
+    field.width = width;
+    field.height = height;
+    field.magnitude.assign(static_cast<size_t>(width) * height, 0.0f);
+    field.direction.assign(static_cast<size_t>(width) * height, 0);
 
-    // Row 2
-    img(2, 0, 0) = 255; img(2, 0, 1) = 128; img(2, 0, 2) = 0;    // Orange
-    img(2, 1, 0) = 128; img(2, 1, 1) = 255; img(2, 1, 2) = 0;    // Light Green
-    img(2, 2, 0) = 128; img(2, 2, 1) = 0;   img(2, 2, 2) = 255;  // Purple
-    img(2, 3, 0) = 255; img(2, 3, 1) = 128; img(2, 3, 2) = 128;  // Pink
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            int ym = max(0, y - 1);
+            int yp = min(height - 1, y + 1);
+            for (int x = 0; x < width; x++) {
+                int xm = max(0, x - 1);
+                int xp = min(width - 1, x + 1);
 
-    // Row 3
-    img(3, 0, 0) = 128; img(3, 0, 1) = 255; img(3, 0, 2) = 128;  // Light Green
-    img(3, 1, 0) = 128; img(3, 1, 1) = 128; img(3, 1, 2) = 255;  // Light Blue
-    img(3, 2, 0) = 255; img(3, 2, 1) = 255; img(3, 2, 2) = 128;  // Light Yellow
-    img(3, 3, 0) = 0;   img(3, 3, 1) = 0;   img(3, 3, 2) = 0;    // Black
+                int gx = (gray(ym, xp, 0) + 2 * gray(y, xp, 0) + gray(yp, xp, 0))
+                       - (gray(ym, xm, 0) + 2 * gray(y, xm, 0) + gray(yp, xm, 0));
+                int gy = (gray(yp, xm, 0) + 2 * gray(yp, x, 0) + gray(yp, xp, 0))
+                       - (gray(ym, xm, 0) + 2 * gray(ym, x, 0) + gray(ym, xp, 0));
 
-    img.savePPM("outbut.ppm");
-    cout << "Created 4x4 test image:outbut.ppm " << endl;
+                size_t i = static_cast<size_t>(y) * width + x;
+                field.magnitude[i] = sqrt(static_cast<float>(gx * gx + gy * gy));
 
-    // Print the image data to console
-    cout << "\nOriginal image data:\n";
-    img.print();
+                // Angle in [0, 180) quantized to the nearest multiple of 45 degrees
+                float angle = atan2(static_cast<float>(gy), static_cast<float>(gx)) * 180.0f / 3.14159265f;
+                if (angle < 0) angle += 180.0f;
+                field.direction[i] = static_cast<unsigned char>(static_cast<int>((angle + 22.5f) / 45.0f) % 4);
+            }
+        }
+    });
+
+    return field;
 }
 
-int main() {
+// Disjoint-set helpers over a flat parent array (used by hysteresis and labelling)
+int findRoot(vector<int>& parent, int i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]]; // path halving
+        i = parent[i];
+    }
+    return i;
+}
 
-    cout << "Image Processing with Matrices - Student Project\n";
-    cout << "================================================\n\n";
+int findRootReadOnly(const vector<int>& parent, int i) {
+    while (parent[i] != i) {
+        i = parent[i];
+    }
+    return i;
+}
 
-    // Create a 4x4 test image
-    createTestImage("test_image.ppm");
+void unite(vector<int>& parent, int a, int b) {
+    a = findRoot(parent, a);
+    b = findRoot(parent, b);
+    if (a == b) return;
+    // Smaller index becomes the root so results do not depend on merge order
+    if (a < b) parent[b] = a;
+    else parent[a] = b;
+}
 
-    // Load the image
-    Image input;
-    if (!input.loadPPM("test_image.ppm")) {
-        cerr << "Failed to load image. Exiting.\n";
-        return 1;
-    }
+/**
+ * Detects edges with the Canny algorithm
+ *
+ * Steps:
+ * 1. Compute the Sobel gradient magnitude and direction
+ * 2. Non-maximum suppression: keep a pixel only if its magnitude is not
+ *    smaller than both neighbors along the gradient direction
+ * 3. Double threshold: pixels >= highThreshold are strong, pixels >= lowThreshold are weak
+ * 4. Hysteresis: keep weak pixels only if they are 8-connected to a strong pixel
+ *    - Each row band builds a union-find forest of its candidate pixels in parallel
+ *    - Bands are stitched together by uniting candidates across band borders
+ *    - Components containing a strong pixel are kept
+ * 5. Return a single-channel image with edges set to 255
+ */
+Image detectEdgesCanny(const Image& input, float lowThreshold, float highThreshold) {
+    GradientField field = computeGradient(input);
+    int height = field.height;
+    int width = field.width;
+    Image output(width, height, 1);
+    if (width == 0 || height == 0) return output;
 
-    cout << "\nImage loaded successfully. Dimensions: "
-        << input.getWidth() << "x" << input.getHeight() << "\n\n";
+    // Neighbor offsets along each quantized gradient direction
+    const int dx[4] = { 1, 1, 0, -1 };
+    const int dy[4] = { 0, 1, 1, 1 };
 
-    // Apply various transformations
-    cout << "Applying image transformations...\n";
+    // 0: suppressed, 1: weak, 2: strong
+    vector<unsigned char> state(static_cast<size_t>(width) * height, 0);
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                size_t i = static_cast<size_t>(y) * width + x;
+                float m = field.magnitude[i];
+                if (m < lowThreshold) continue;
 
-    Image gray = convertToGrayscale(input);
-    gray.savePPM("gray_image.ppm");
-    cout << "- Grayscale conversion completed\n";
-    cout << "Grayscale image data:\n";
-    gray.print();
-    cout << endl;
+                int d = field.direction[i];
+                int ax = x + dx[d], ay = y + dy[d];
+                int bx = x - dx[d], by = y - dy[d];
+                float a = (ax >= 0 && ax < width && ay >= 0 && ay < height) ? field.magnitude[static_cast<size_t>(ay) * width + ax] : 0.0f;
+                float b = (bx >= 0 && bx < width && by >= 0 && by < height) ? field.magnitude[static_cast<size_t>(by) * width + bx] : 0.0f;
+                if (m < a || m < b) continue;
 
-    Image flippedH = flipHorizontal(input);
-    flippedH.savePPM("flipped_horizontal.ppm");
-    cout << "- Horizontal flip completed\n";
-    cout << "Horizontally flipped image data:\n";
-    flippedH.print();
-    cout << endl;
+                state[i] = m >= highThreshold ? 2 : 1;
+            }
+        }
+    });
 
-    Image flippedV = flipVertical(input);
-    flippedV.savePPM("flipped_vertical.ppm");
-    cout << "- Vertical flip completed\n";
-    cout << "Vertically flipped image data:\n";
-    flippedV.print();
-    cout << endl;
+    // Union-find over candidate pixels; each band only links pixels inside itself
+    vector<int> parent(static_cast<size_t>(width) * height);
+    vector<int> bandStarts;
+    mutex bandMutex;
+    parallelFor(0, height, [&](int y0, int y1) {
+        {
+            lock_guard<mutex> lock(bandMutex);
+            bandStarts.push_back(y0);
+        }
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                int i = y * width + x;
+                parent[i] = i;
+                if (!state[i]) continue;
+                // Previously visited neighbors: left, and the three above (inside this band)
+                if (x > 0 && state[i - 1]) unite(parent, i, i - 1);
+                if (y > y0) {
+                    for (int kx = -1; kx <= 1; kx++) {
+                        int nx = x + kx;
+                        if (nx >= 0 && nx < width && state[i - width + kx]) unite(parent, i, i - width + kx);
+                    }
+                }
+            }
+        }
+    });
 
-    Image bright = adjustBrightness(input, 50);
-    bright.savePPM("bright_image.ppm");
-    cout << "- Brightness adjustment completed\n";
-    cout << "Brightness adjusted image data:\n";
-    bright.print();
-    cout << endl;
+    // Stitch band borders: link the first row of each band to the last row of the previous one
+    for (int y : bandStarts) {
+        if (y == 0) continue;
+        for (int x = 0; x < width; x++) {
+            int i = y * width + x;
+            if (!state[i]) continue;
+            for (int kx = -1; kx <= 1; kx++) {
+                int nx = x + kx;
+                if (nx < 0 || nx >= width) continue;
+                int j = i - width + kx;
+                if (state[j] && findRoot(parent, i) != findRoot(parent, j)) unite(parent, i, j);
+            }
+        }
+    }
 
-    Image contrast = adjustContrast(input, 1.5f);
-    contrast.savePPM("contrast_image.ppm");
-    cout << "- Contrast adjustment completed\n";
-    cout << "Contrast adjusted image data:\n";
-    contrast.print();
-    cout << endl;
+    // Mark components that contain a strong pixel (roots are collected per band, then merged)
+    vector<unsigned char> keep(static_cast<size_t>(width) * height, 0);
+    parallelFor(0, height, [&](int y0, int y1) {
+        vector<int> strongRoots;
+        for (int i = y0 * width; i < y1 * width; i++) {
+            if (state[i] == 2) strongRoots.push_back(findRootReadOnly(parent, i));
+        }
+        lock_guard<mutex> lock(bandMutex);
+        for (int root : strongRoots) keep[root] = 1;
+    });
 
-    Image blur = applyBlur(input);
-    blur.savePPM("blurred_image.ppm");
-    cout << "- Blur filter completed\n";
-    cout << "Blurred image data:\n";
-    blur.print();
-    cout << endl;
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                int i = y * width + x;
+                if (state[i] && keep[findRootReadOnly(parent, i)]) output(y, x, 0) = 255;
+            }
+        }
+    });
 
-    Image rotated = rotate90Clockwise(input);
-    rotated.savePPM("rotated90_image.ppm");
-    cout << "- 90-degree rotation completed\n";
-    cout << "Rotated image data:\n";
-    rotated.print();
+    return output;
+}
+
+// Rectangular region of interest; a zero width or height means the whole image
+struct Region {
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+};
+
+// Clips a region to the image bounds, expanding an empty region to the full image
+Region clipRegion(const Image& img, Region roi) {
+    if (roi.width <= 0 || roi.height <= 0) {
+        roi.x = 0;
+        roi.y = 0;
+        roi.width = img.getWidth();
+        roi.height = img.getHeight();
+    }
+    int x0 = max(0, roi.x), y0 = max(0, roi.y);
+    int x1 = min(img.getWidth(), roi.x + roi.width);
+    int y1 = min(img.getHeight(), roi.y + roi.height);
+    roi.x = x0;
+    roi.y = y0;
+    roi.width = max(0, x1 - x0);
+    roi.height = max(0, y1 - y0);
+    return roi;
+}
+
+// Luminance of a pixel (BT.601 weights, same as convertToGrayscale)
+int luminanceAt(const Image& img, int y, int x) {
+    if (img.getChannels() < 3) return img(y, x, 0);
+    return static_cast<int>(0.299 * img(y, x, 0) + 0.587 * img(y, x, 1) + 0.114 * img(y, x, 2));
+}
+
+/**
+ * Computes per-channel histograms of an image
+ *
+ * Steps:
+ * 1. Create (maxVal + 1) bins per channel, so 8-bit and 16-bit data are both supported
+ * 2. Split the region of interest into row bands processed in parallel
+ * 3. Each band counts into its own private bins; consecutive pixels rotate through
+ *    4 sub-histograms so runs of equal values do not serialize on one counter
+ * 4. Merge the private bins into the result
+ * 5. Return counts indexed as [channel][value]; out-of-range values are clamped
+ */
+vector<vector<long long>> computeHistogram(const Image& input, Region roi = Region()) {
+    roi = clipRegion(input, roi);
+    int channels = input.getChannels();
+    int bins = input.getMaxVal() + 1;
+    vector<vector<long long>> histogram(channels, vector<long long>(bins, 0));
+    mutex mergeMutex;
+
+    parallelFor(roi.y, roi.y + roi.height, [&](int y0, int y1) {
+        const int lanes = 4;
+        vector<unsigned int> local(static_cast<size_t>(channels) * lanes * bins, 0);
+        for (int y = y0; y < y1; y++) {
+            for (int x = roi.x; x < roi.x + roi.width; x++) {
+                int lane = x & (lanes - 1);
+                for (int c = 0; c < channels; c++) {
+                    int v = max(0, min(bins - 1, input(y, x, c)));
+                    local[(static_cast<size_t>(c) * lanes + lane) * bins + v]++;
+                }
+            }
+        }
+
+        lock_guard<mutex> lock(mergeMutex);
+        for (int c = 0; c < channels; c++) {
+            for (int lane = 0; lane < lanes; lane++) {
+                const unsigned int* counts = &local[(static_cast<size_t>(c) * lanes + lane) * bins];
+                for (int v = 0; v < bins; v++) {
+                    histogram[c][v] += counts[v];
+                }
+            }
+        }
+    });
+
+    return histogram;
+}
+
+/**
+ * Computes the luminance histogram of an image
+ *
+ * Steps:
+ * 1. For each pixel in the region of interest, compute the luminance
+ *    (the single channel for grayscale images)
+ * 2. Count it in per-band private bins, as in computeHistogram
+ * 3. Return the merged (maxVal + 1) bin counts
+ */
+vector<long long> computeLuminanceHistogram(const Image& input, Region roi = Region()) {
+    roi = clipRegion(input, roi);
+    int bins = input.getMaxVal() + 1;
+    vector<long long> histogram(bins, 0);
+    mutex mergeMutex;
+
+    parallelFor(roi.y, roi.y + roi.height, [&](int y0, int y1) {
+        const int lanes = 4;
+        vector<unsigned int> local(static_cast<size_t>(lanes) * bins, 0);
+        for (int y = y0; y < y1; y++) {
+            for (int x = roi.x; x < roi.x + roi.width; x++) {
+                int v = max(0, min(bins - 1, luminanceAt(input, y, x)));
+                local[static_cast<size_t>(x & (lanes - 1)) * bins + v]++;
+            }
+        }
+
+        lock_guard<mutex> lock(mergeMutex);
+        for (int lane = 0; lane < lanes; lane++) {
+            for (int v = 0; v < bins; v++) {
+                histogram[v] += local[static_cast<size_t>(lane) * bins + v];
+            }
+        }
+    });
+
+    return histogram;
+}
+
+/**
+ * Applies a lookup table to every channel of an image
+ *
+ * Steps:
+ * 1. Shape output like the input (its storage is reused when it already matches)
+ * 2. For each pixel and each channel (rows processed in parallel bands):
+ *    - Clamp the value to the table range
+ *    - Replace it with lut[value]
+ */
+void applyLUT(const Image& input, const vector<int>& lut, Image& output) {
+    int height = input.getHeight();
+    int width = input.getWidth();
+    int channels = input.getChannels();
+    reshapeImage(output, width, height, channels, input.getMaxVal());
+    int last = static_cast<int>(lut.size()) - 1;
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < channels; c++) {
+                    output(y, x, c) = lut[max(0, min(last, input(y, x, c)))];
+                }
+            }
+        }
+    });
+}
+
+// Applies a lookup table, returning a new image
+Image applyLUT(const Image& input, const vector<int>& lut) {
+    Image output;
+    applyLUT(input, lut, output);
+    return output;
+}
+
+/**
+ * Equalizes the image histogram
+ *
+ * Steps:
+ * 1. Compute the luminance histogram (first pass)
+ * 2. Build the cumulative distribution (CDF) and map each value v to
+ *        lut[v] = (cdf[v] - cdfMin) * maxVal / (total - cdfMin)
+ * 3. Apply the table to every channel (second pass)
+ * 4. Return the equalized image
+ */
+Image equalizeHistogram(const Image& input) {
+    vector<long long> histogram = computeLuminanceHistogram(input);
+    int maxVal = input.getMaxVal();
+    vector<int> lut(histogram.size());
+
+    long long total = 0, cdfMin = 0;
+    for (long long count : histogram) {
+        if (cdfMin == 0) cdfMin = count;
+        total += count;
+    }
+
+    long long cdf = 0;
+    for (size_t v = 0; v < histogram.size(); v++) {
+        cdf += histogram[v];
+        if (total == cdfMin) {
+            lut[v] = static_cast<int>(v); // flat image: leave unchanged
+        }
+        else {
+            long long mapped = (max(0LL, cdf - cdfMin) * maxVal + (total - cdfMin) / 2) / (total - cdfMin);
+            lut[v] = static_cast<int>(mapped);
+        }
+    }
+
+    return applyLUT(input, lut);
+}
+
+/**
+ * Stretches the image levels between two luminance percentiles
+ *
+ * Steps:
+ * 1. Compute the luminance histogram (first pass)
+ * 2. Find the values below which lowPercent and highPercent of the pixels fall
+ * 3. Build a table mapping [low, high] linearly to [0, maxVal], clamping outside
+ * 4. Apply the table to every channel (second pass)
+ * 5. Return the stretched image
+ */
+Image autoLevels(const Image& input, float lowPercent = 0.5f, float highPercent = 99.5f) {
+    vector<long long> histogram = computeLuminanceHistogram(input);
+    int maxVal = input.getMaxVal();
+
+    long long total = 0;
+    for (long long count : histogram) total += count;
+
+    // In double: float's 24-bit mantissa would round the cutoffs above ~16M pixels
+    long long lowCount = static_cast<long long>(static_cast<double>(total) * lowPercent / 100.0);
+    long long highCount = static_cast<long long>(static_cast<double>(total) * highPercent / 100.0);
+    int low = 0, high = maxVal;
+    long long cdf = 0;
+    bool lowFound = false;
+    for (int v = 0; v <= maxVal; v++) {
+        cdf += histogram[v];
+        if (!lowFound && cdf > lowCount) {
+            low = v;
+            lowFound = true;
+        }
+        if (cdf >= highCount) {
+            high = v;
+            break;
+        }
+    }
+
+    vector<int> lut(maxVal + 1);
+    for (int v = 0; v <= maxVal; v++) {
+        if (high <= low) {
+            lut[v] = v;
+        }
+        else {
+            int stretched = static_cast<int>((static_cast<long long>(v - low) * maxVal + (high - low) / 2) / (high - low));
+            lut[v] = max(0, min(maxVal, stretched));
+        }
+    }
+
+    return applyLUT(input, lut);
+}
+
+/**
+ * Applies contrast-limited adaptive histogram equalization (CLAHE)
+ *
+ * Steps:
+ * 1. Split the image into tilesX x tilesY tiles (edge tiles may be smaller)
+ * 2. For each tile, in parallel:
+ *    - Compute the luminance histogram of the tile
+ *    - Clip every bin at clipLimit times the average bin count and
+ *      redistribute the clipped excess evenly over all bins
+ *    - Build an equalization table from the clipped histogram's CDF
+ * 3. For each pixel (rows processed in parallel bands):
+ *    - Find the four nearest tile centers
+ *    - Map the value through their four tables and blend bilinearly
+ * 4. Return the enhanced image (color images use the luminance tables for every channel)
+ */
+Image applyCLAHE(const Image& input, int tilesX = 8, int tilesY = 8, float clipLimit = 2.0f) {
+    int height = input.getHeight();
+    int width = input.getWidth();
+    int channels = input.getChannels();
+    int maxVal = input.getMaxVal();
+    int bins = maxVal + 1;
+    Image output(width, height, channels);
+    output.setMaxVal(maxVal);
+    if (width == 0 || height == 0) return output;
+
+    tilesX = max(1, min(tilesX, width));
+    tilesY = max(1, min(tilesY, height));
+    int tileW = (width + tilesX - 1) / tilesX;
+    int tileH = (height + tilesY - 1) / tilesY;
+    tilesX = (width + tileW - 1) / tileW;
+    tilesY = (height + tileH - 1) / tileH;
+
+    // One table per tile, stored as [tile][value]
+    vector<int> luts(static_cast<size_t>(tilesX) * tilesY * bins);
+    parallelFor(0, tilesX * tilesY, [&](int t0, int t1) {
+        vector<long long> histogram(bins);
+        for (int t = t0; t < t1; t++) {
+            Region tile;
+            tile.x = (t % tilesX) * tileW;
+            tile.y = (t / tilesX) * tileH;
+            tile.width = min(tileW, width - tile.x);
+            tile.height = min(tileH, height - tile.y);
+
+            fill(histogram.begin(), histogram.end(), 0);
+            for (int y = tile.y; y < tile.y + tile.height; y++) {
+                for (int x = tile.x; x < tile.x + tile.width; x++) {
+                    histogram[max(0, min(maxVal, luminanceAt(input, y, x)))]++;
+                }
+            }
+
+            long long pixels = static_cast<long long>(tile.width) * tile.height;
+            long long limit = max(1LL, static_cast<long long>(clipLimit * pixels / bins));
+            long long excess = 0;
+            for (int v = 0; v < bins; v++) {
+                if (histogram[v] > limit) {
+                    excess += histogram[v] - limit;
+                    histogram[v] = limit;
+                }
+            }
+            long long share = excess / bins;
+            long long remainder = excess % bins;
+            for (int v = 0; v < bins; v++) {
+                histogram[v] += share;
+            }
+            // Spread the remainder at a regular stride so no range is favored
+            if (remainder > 0) {
+                long long step = max(1LL, bins / remainder);
+                for (long long v = 0; v < bins && remainder > 0; v += step, remainder--) {
+                    histogram[v]++;
+                }
+            }
+
+            int* lut = &luts[static_cast<size_t>(t) * bins];
+            long long cdf = 0;
+            for (int v = 0; v < bins; v++) {
+                cdf += histogram[v];
+                lut[v] = static_cast<int>(min<long long>(maxVal, cdf * maxVal / pixels));
+            }
+        }
+    }, 1);
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            // Position relative to the tile centers above and below
+            float fy = (y + 0.5f) / tileH - 0.5f;
+            int ty0 = static_cast<int>(floor(fy));
+            float wy = fy - ty0;
+            int ty1 = min(tilesY - 1, ty0 + 1);
+            ty0 = max(0, ty0);
+
+            for (int x = 0; x < width; x++) {
+                float fx = (x + 0.5f) / tileW - 0.5f;
+                int tx0 = static_cast<int>(floor(fx));
+                float wx = fx - tx0;
+                int tx1 = min(tilesX - 1, tx0 + 1);
+                tx0 = max(0, tx0);
+
+                const int* lut00 = &luts[static_cast<size_t>(ty0 * tilesX + tx0) * bins];
+                const int* lut01 = &luts[static_cast<size_t>(ty0 * tilesX + tx1) * bins];
+                const int* lut10 = &luts[static_cast<size_t>(ty1 * tilesX + tx0) * bins];
+                const int* lut11 = &luts[static_cast<size_t>(ty1 * tilesX + tx1) * bins];
+
+                for (int c = 0; c < channels; c++) {
+                    int v = max(0, min(maxVal, input(y, x, c)));
+                    float top = lut00[v] + wx * (lut01[v] - lut00[v]);
+                    float bottom = lut10[v] + wx * (lut11[v] - lut10[v]);
+                    output(y, x, c) = static_cast<int>(top + wy * (bottom - top) + 0.5f);
+                }
+            }
+        }
+    });
+
+    return output;
+}
+
+// Summed-area tables of luminance and squared luminance, each (width + 1) x (height + 1)
+struct IntegralImage {
+    int width = 0;
+    int height = 0;
+    vector<long long> sum;   // [y * (width + 1) + x] = sum over rows < y, columns < x
+    vector<long long> sumSq;
+
+    // Sum of values in the rectangle [x0, x1) x [y0, y1)
+    long long rectSum(int x0, int y0, int x1, int y1) const {
+        size_t stride = static_cast<size_t>(width) + 1;
+        return sum[y1 * stride + x1] - sum[y0 * stride + x1] - sum[y1 * stride + x0] + sum[y0 * stride + x0];
+    }
+
+    long long rectSumSq(int x0, int y0, int x1, int y1) const {
+        size_t stride = static_cast<size_t>(width) + 1;
+        return sumSq[y1 * stride + x1] - sumSq[y0 * stride + x1] - sumSq[y1 * stride + x0] + sumSq[y0 * stride + x0];
+    }
+};
+
+/**
+ * Builds the summed-area tables of an image's luminance
+ *
+ * Steps:
+ * 1. Row pass (rows in parallel): prefix sums of each row
+ * 2. Column pass (column bands in parallel): add the row above to each row
+ * 3. Return the tables; any rectangle sum is then 4 lookups
+ */
+IntegralImage computeIntegralImage(const Image& input) {
+    IntegralImage integral;
+    int height = input.getHeight();
+    int width = input.getWidth();
+    int stride = width + 1;
+    integral.width = width;
+    integral.height = height;
+    integral.sum.assign(static_cast<size_t>(stride) * (height + 1), 0);
+    integral.sumSq.assign(static_cast<size_t>(stride) * (height + 1), 0);
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            long long rowSum = 0, rowSumSq = 0;
+            size_t base = static_cast<size_t>(y + 1) * stride;
+            for (int x = 0; x < width; x++) {
+                long long v = luminanceAt(input, y, x);
+                rowSum += v;
+                rowSumSq += v * v;
+                integral.sum[base + x + 1] = rowSum;
+                integral.sumSq[base + x + 1] = rowSumSq;
+            }
+        }
+    });
+
+    parallelFor(1, stride, [&](int x0, int x1) {
+        for (int y = 2; y <= height; y++) {
+            size_t base = static_cast<size_t>(y) * stride;
+            for (int x = x0; x < x1; x++) {
+                integral.sum[base + x] += integral.sum[base - stride + x];
+                integral.sumSq[base + x] += integral.sumSq[base - stride + x];
+            }
+        }
+    });
+
+    return integral;
+}
+
+/**
+ * Converts an image to a mask with a fixed threshold
+ *
+ * Steps:
+ * 1. Create a mask with the same width and height as the input
+ * 2. For each pixel (rows processed in parallel bands):
+ *    - Set the bit if the luminance is greater than the threshold
+ *    - Bits are gathered 64 at a time and written as one word
+ * 3. Return the mask
+ */
+BitMask thresholdImage(const Image& input, int threshold) {
+    int height = input.getHeight();
+    int width = input.getWidth();
+    BitMask mask(width, height);
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            uint64_t* words = mask.row(y);
+            for (int x = 0; x < width; x += 64) {
+                uint64_t word = 0;
+                int count = min(64, width - x);
+                for (int b = 0; b < count; b++) {
+                    if (luminanceAt(input, y, x + b) > threshold) word |= uint64_t(1) << b;
+                }
+                words[x / 64] = word;
+            }
+        }
+    });
+
+    return mask;
+}
+
+/**
+ * Finds the global threshold with Otsu's method
+ *
+ * Steps:
+ * 1. Compute the luminance histogram (single pass over the image)
+ * 2. For each candidate threshold t, split the histogram into
+ *    background (<= t) and foreground (> t)
+ * 3. Return the t that maximizes the between-class variance
+ *        w0 * w1 * (mean0 - mean1)^2
+ */
+int computeOtsuThreshold(const Image& input) {
+    vector<long long> histogram = computeLuminanceHistogram(input);
+    double total = 0, weightedTotal = 0;
+    for (size_t v = 0; v < histogram.size(); v++) {
+        total += histogram[v];
+        weightedTotal += static_cast<double>(v) * histogram[v];
+    }
+
+    double w0 = 0, sum0 = 0, bestVariance = -1;
+    int best = 0;
+    for (size_t v = 0; v < histogram.size(); v++) {
+        w0 += histogram[v];
+        sum0 += static_cast<double>(v) * histogram[v];
+        double w1 = total - w0;
+        if (w0 == 0) continue;
+        if (w1 == 0) break;
+
+        double mean0 = sum0 / w0;
+        double mean1 = (weightedTotal - sum0) / w1;
+        double variance = w0 * w1 * (mean0 - mean1) * (mean0 - mean1);
+        if (variance > bestVariance) {
+            bestVariance = variance;
+            best = static_cast<int>(v);
+        }
+    }
+
+    return best;
+}
+
+// Binarizes an image with Otsu's threshold
+BitMask thresholdOtsu(const Image& input) {
+    return thresholdImage(input, computeOtsuThreshold(input));
+}
+
+/**
+ * Binarizes an image against the mean of a local window
+ *
+ * Steps:
+ * 1. Build the summed-area table of the luminance
+ * 2. For each pixel (rows processed in parallel bands):
+ *    - Clip a windowSize x windowSize window centered on the pixel
+ *    - mean = window sum / window area (4 lookups, independent of window size)
+ *    - Set the bit if the luminance is greater than mean - offset
+ * 3. Return the mask
+ */
+BitMask thresholdAdaptiveMean(const Image& input, int windowSize = 15, int offset = 5) {
+    int height = input.getHeight();
+    int width = input.getWidth();
+    BitMask mask(width, height);
+    IntegralImage integral = computeIntegralImage(input);
+    int half = max(1, windowSize) / 2;
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            int wy0 = max(0, y - half), wy1 = min(height, y + half + 1);
+            uint64_t* words = mask.row(y);
+            for (int x = 0; x < width; x += 64) {
+                uint64_t word = 0;
+                int count = min(64, width - x);
+                for (int b = 0; b < count; b++) {
+                    int px = x + b;
+                    int wx0 = max(0, px - half), wx1 = min(width, px + half + 1);
+                    long long area = static_cast<long long>(wx1 - wx0) * (wy1 - wy0);
+                    long long v = luminanceAt(input, y, px);
+                    // v > sum / area - offset, kept in integers
+                    if ((v + offset) * area > integral.rectSum(wx0, wy0, wx1, wy1)) word |= uint64_t(1) << b;
+                }
+                words[x / 64] = word;
+            }
+        }
+    });
+
+    return mask;
+}
+
+/**
+ * Binarizes an image with Sauvola's local threshold
+ *
+ * Steps:
+ * 1. Build the summed-area tables of the luminance and squared luminance
+ * 2. For each pixel (rows processed in parallel bands):
+ *    - Get the local mean m and standard deviation s of the window in O(1)
+ *    - threshold = m * (1 + k * (s / R - 1)), with R = half the value range
+ *    - Set the bit if the luminance is greater than the threshold
+ * 3. Return the mask
+ */
+BitMask thresholdSauvola(const Image& input, int windowSize = 15, float k = 0.34f) {
+    int height = input.getHeight();
+    int width = input.getWidth();
+    BitMask mask(width, height);
+    IntegralImage integral = computeIntegralImage(input);
+    int half = max(1, windowSize) / 2;
+    double range = (input.getMaxVal() + 1) / 2.0;
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            int wy0 = max(0, y - half), wy1 = min(height, y + half + 1);
+            uint64_t* words = mask.row(y);
+            for (int x = 0; x < width; x += 64) {
+                uint64_t word = 0;
+                int count = min(64, width - x);
+                for (int b = 0; b < count; b++) {
+                    int px = x + b;
+                    int wx0 = max(0, px - half), wx1 = min(width, px + half + 1);
+                    double area = static_cast<double>(wx1 - wx0) * (wy1 - wy0);
+                    double mean = integral.rectSum(wx0, wy0, wx1, wy1) / area;
+                    double variance = integral.rectSumSq(wx0, wy0, wx1, wy1) / area - mean * mean;
+                    double deviation = sqrt(max(0.0, variance));
+                    double threshold = mean * (1.0 + k * (deviation / range - 1.0));
+                    if (luminanceAt(input, y, px) > threshold) word |= uint64_t(1) << b;
+                }
+                words[x / 64] = word;
+            }
+        }
+    });
+
+    return mask;
+}
+
+// Converts a mask to a single-channel image (set bits become maxVal, clear bits 0)
+Image maskToImage(const BitMask& mask, int maxVal = 255) {
+    int height = mask.getHeight();
+    int width = mask.getWidth();
+    Image output(width, height, 1);
+    output.setMaxVal(maxVal);
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                output(y, x, 0) = mask.get(y, x) ? maxVal : 0;
+            }
+        }
+    });
+
+    return output;
+}
+
+/**
+ * Combines two masks of the same size word by word
+ *
+ * Steps:
+ * 1. Create a mask with the same dimensions
+ * 2. For each 64-bit word, combine the two inputs with the given operation
+ * 3. Return the combined mask (an empty mask if the sizes differ)
+ */
+template <typename Op>
+BitMask combineMasks(const BitMask& a, const BitMask& b, Op op) {
+    if (a.getWidth() != b.getWidth() || a.getHeight() != b.getHeight()) {
+        cerr << "Error: Mask sizes do not match" << endl;
+        return BitMask();
+    }
+
+    BitMask output(a.getWidth(), a.getHeight());
+    int words = a.getWordsPerRow();
+    parallelFor(0, a.getHeight(), [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            const uint64_t* wa = a.row(y);
+            const uint64_t* wb = b.row(y);
+            uint64_t* out = output.row(y);
+            for (int i = 0; i < words; i++) {
+                out[i] = op(wa[i], wb[i]);
+            }
+        }
+    });
+
+    return output;
+}
+
+BitMask maskAnd(const BitMask& a, const BitMask& b) {
+    return combineMasks(a, b, [](uint64_t x, uint64_t y) { return x & y; });
+}
+
+BitMask maskOr(const BitMask& a, const BitMask& b) {
+    return combineMasks(a, b, [](uint64_t x, uint64_t y) { return x | y; });
+}
+
+BitMask maskXor(const BitMask& a, const BitMask& b) {
+    return combineMasks(a, b, [](uint64_t x, uint64_t y) { return x ^ y; });
+}
+
+// Inverts every pixel of a mask, keeping the row padding bits clear
+BitMask maskNot(const BitMask& input) {
+    BitMask output(input.getWidth(), input.getHeight());
+    int words = input.getWordsPerRow();
+    uint64_t last = input.lastWordMask();
+    parallelFor(0, input.getHeight(), [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            const uint64_t* in = input.row(y);
+            uint64_t* out = output.row(y);
+            for (int i = 0; i < words; i++) {
+                out[i] = ~in[i];
+            }
+            if (words > 0) out[words - 1] &= last;
+        }
+    });
+
+    return output;
+}
+
+// Counts the set pixels of a mask with one popcount per word
+long long maskArea(const BitMask& mask) {
+    long long area = 0;
+    mutex sumMutex;
+    parallelFor(0, mask.getHeight(), [&](int y0, int y1) {
+        long long local = 0;
+        for (int y = y0; y < y1; y++) {
+            const uint64_t* words = mask.row(y);
+            for (int i = 0; i < mask.getWordsPerRow(); i++) {
+                local += popcount64(words[i]);
+            }
+        }
+        lock_guard<mutex> lock(sumMutex);
+        area += local;
+    });
+
+    return area;
+}
+
+/**
+ * Adjusts brightness only where the mask is set
+ *
+ * Steps:
+ * 1. Copy the input image
+ * 2. For each 64-pixel word of the mask (rows processed in parallel bands):
+ *    - Skip the word entirely if no bit is set
+ *    - Otherwise add the brightness value (8-bit units scaled to maxVal, as in
+ *      adjustBrightness) to each selected pixel and clamp to [0, maxVal]
+ * 3. Return the adjusted image
+ */
+Image adjustBrightness(const Image& input, int value, const BitMask& mask) {
+    Image output = input;
+    int width = min(input.getWidth(), mask.getWidth());
+    int height = min(input.getHeight(), mask.getHeight());
+    int channels = input.getChannels();
+    int maxVal = input.getMaxVal();
+    int offset = static_cast<int>(lround(static_cast<double>(value) * maxVal / 255));
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            const uint64_t* words = mask.row(y);
+            for (int x = 0; x < width; x += 64) {
+                uint64_t word = words[x / 64];
+                while (word != 0) {
+                    int b = 0;
+                    while (!((word >> b) & 1)) b++;
+                    word &= word - 1; // clear lowest set bit
+                    int px = x + b;
+                    if (px >= width) break;
+                    for (int c = 0; c < channels; c++) {
+                        output(y, px, c) = max(0, min(maxVal, input(y, px, c) + offset));
+                    }
+                }
+            }
+        }
+    });
+
+    return output;
+}
+
+/**
+ * Applies the 3x3 blur only where the mask is set
+ *
+ * Steps:
+ * 1. Copy the input image
+ * 2. For each selected pixel (excluding borders, which are left unchanged):
+ *    - Replace each channel with the average of its 3x3 neighborhood in the input
+ * 3. Return the blurred image
+ */
+Image applyBlur(const Image& input, const BitMask& mask) {
+    Image output = input;
+    int width = min(input.getWidth(), mask.getWidth());
+    int height = min(input.getHeight(), mask.getHeight());
+    int channels = input.getChannels();
+
+    parallelFor(1, height - 1, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            const uint64_t* words = mask.row(y);
+            for (int x = 0; x < width; x += 64) {
+                uint64_t word = words[x / 64];
+                if (word == 0) continue;
+                int count = min(64, width - x);
+                for (int b = 0; b < count; b++) {
+                    int px = x + b;
+                    if (!((word >> b) & 1) || px == 0 || px == input.getWidth() - 1) continue;
+                    for (int c = 0; c < channels; c++) {
+                        int sum = 0;
+                        for (int ky = -1; ky <= 1; ky++) {
+                            for (int kx = -1; kx <= 1; kx++) {
+                                sum += input(y + ky, px + kx, c);
+                            }
+                        }
+                        output(y, px, c) = sum / 9;
+                    }
+                }
+            }
+        }
+    });
+
+    return output;
+}
+
+// Statistics of one connected component
+struct ComponentStats {
+    long long area = 0;
+    int minX = 0, minY = 0, maxX = 0, maxY = 0; // bounding box (inclusive)
+    double centroidX = 0, centroidY = 0;
+};
+
+// Label image (0 = background, component i has label i + 1) and per-component statistics
+struct LabelResult {
+    int width = 0;
+    int height = 0;
+    vector<int> labels; // [y * width + x]
+    vector<ComponentStats> components;
+};
+
+/**
+ * Labels the connected components of a mask
+ *
+ * Steps:
+ * 1. Each row band scans its pixels in parallel and links each set pixel to its
+ *    already-visited neighbors with union-find; for 8-connectivity a decision tree
+ *    checks the pixel above first, since it already covers its own neighbors
+ * 2. Band borders are stitched by linking the first row of each band to the row above
+ * 3. Each band resolves pixel roots and accumulates area, bounding box and
+ *    coordinate sums per root; band results are merged
+ * 4. Components are numbered in raster order of their first pixel
+ * 5. Return the label image and the component statistics
+ */
+LabelResult labelComponents(const BitMask& mask, int connectivity = 8) {
+    int height = mask.getHeight();
+    int width = mask.getWidth();
+    bool diagonal = connectivity == 8;
+    LabelResult result;
+    result.width = width;
+    result.height = height;
+    result.labels.assign(static_cast<size_t>(width) * height, 0);
+    if (width == 0 || height == 0) return result;
+
+    vector<int> parent(static_cast<size_t>(width) * height);
+    vector<int> bandStarts;
+    mutex bandMutex;
+    parallelFor(0, height, [&](int y0, int y1) {
+        {
+            lock_guard<mutex> lock(bandMutex);
+            bandStarts.push_back(y0);
+        }
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                int i = y * width + x;
+                parent[i] = i;
+                if (!mask.get(y, x)) continue;
+
+                bool hasUp = y > y0;
+                bool left = x > 0 && mask.get(y, x - 1);
+                bool up = hasUp && mask.get(y - 1, x);
+                if (up) {
+                    unite(parent, i, i - width);
+                    // With 8-connectivity, left and both upper diagonals already touch the pixel above
+                    if (diagonal) continue;
+                }
+                if (diagonal && hasUp) {
+                    bool upLeft = x > 0 && mask.get(y - 1, x - 1);
+                    bool upRight = x < width - 1 && mask.get(y - 1, x + 1);
+                    if (upRight) unite(parent, i, i - width + 1);
+                    if (upLeft) {
+                        unite(parent, i, i - width - 1);
+                        continue; // left touches the upper-left pixel
+                    }
+                }
+                if (left) unite(parent, i, i - 1);
+            }
+        }
+    });
+
+    for (int y : bandStarts) {
+        if (y == 0) continue;
+        for (int x = 0; x < width; x++) {
+            if (!mask.get(y, x)) continue;
+            int i = y * width + x;
+            for (int kx = diagonal ? -1 : 0; kx <= (diagonal ? 1 : 0); kx++) {
+                int nx = x + kx;
+                if (nx >= 0 && nx < width && mask.get(y - 1, nx)) unite(parent, i, i - width + kx);
+            }
+        }
+    }
+
+    // Per-root statistics; centroids hold coordinate sums until the end
+    unordered_map<int, ComponentStats> stats;
+    parallelFor(0, height, [&](int y0, int y1) {
+        unordered_map<int, ComponentStats> local;
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                if (!mask.get(y, x)) continue;
+                int i = y * width + x;
+                int root = findRootReadOnly(parent, i);
+                result.labels[i] = root;
+
+                auto found = local.find(root);
+                if (found == local.end()) {
+                    ComponentStats fresh;
+                    fresh.minX = fresh.maxX = x;
+                    fresh.minY = fresh.maxY = y;
+                    found = local.emplace(root, fresh).first;
+                }
+                ComponentStats& s = found->second;
+                s.area++;
+                s.minX = min(s.minX, x);
+                s.maxX = max(s.maxX, x);
+                s.maxY = max(s.maxY, y);
+                s.centroidX += x;
+                s.centroidY += y;
+            }
+        }
+
+        lock_guard<mutex> lock(bandMutex);
+        for (auto& entry : local) {
+            auto found = stats.find(entry.first);
+            if (found == stats.end()) {
+                stats.emplace(entry.first, entry.second);
+                continue;
+            }
+            ComponentStats& s = found->second;
+            s.area += entry.second.area;
+            s.minX = min(s.minX, entry.second.minX);
+            s.minY = min(s.minY, entry.second.minY);
+            s.maxX = max(s.maxX, entry.second.maxX);
+            s.maxY = max(s.maxY, entry.second.maxY);
+            s.centroidX += entry.second.centroidX;
+            s.centroidY += entry.second.centroidY;
+        }
+    });
+
+    // The root of each component is its first pixel, so sorting roots gives raster order
+    vector<int> roots;
+    roots.reserve(stats.size());
+    for (auto& entry : stats) roots.push_back(entry.first);
+    sort(roots.begin(), roots.end());
+
+    unordered_map<int, int> labelOf;
+    result.components.reserve(roots.size());
+    for (size_t k = 0; k < roots.size(); k++) {
+        ComponentStats s = stats[roots[k]];
+        s.centroidX /= s.area;
+        s.centroidY /= s.area;
+        result.components.push_back(s);
+        labelOf[roots[k]] = static_cast<int>(k) + 1;
+    }
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                int i = y * width + x;
+                if (mask.get(y, x)) result.labels[i] = labelOf.at(result.labels[i]);
+            }
+        }
+    });
+
+    return result;
+}
+
+// Luma coefficients for YCbCr conversion
+enum class ColorStandard { BT601, BT709 };
+
+// Clamps and rounds a converted value to an integer sample
+int toSample(float value, int maxVal) {
+    return max(0, min(maxVal, static_cast<int>(floor(value + 0.5f))));
+}
+
+/**
+ * Applies a per-pixel color conversion to a 3-channel image
+ *
+ * Steps:
+ * 1. Create a new 3-channel image with the same dimensions and maxVal
+ * 2. For each pixel (rows processed in parallel bands):
+ *    - Pass the three input samples to convert, which writes the three output samples
+ * 3. Return the converted image
+ */
+template <typename Convert>
+Image convertPixels(const Image& input, Convert convert) {
+    int height = input.getHeight();
+    int width = input.getWidth();
+    Image output(width, height, 3);
+    output.setMaxVal(input.getMaxVal());
+    bool gray = input.getChannels() < 3;
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        int out[3];
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                int a = input(y, x, 0);
+                int b = gray ? a : input(y, x, 1);
+                int c = gray ? a : input(y, x, 2);
+                convert(a, b, c, out);
+                output(y, x, 0) = out[0];
+                output(y, x, 1) = out[1];
+                output(y, x, 2) = out[2];
+            }
+        }
+    });
+
+    return output;
+}
+
+/**
+ * Converts RGB to full-range YCbCr
+ *
+ * Steps:
+ * 1. Pick the luma weights Kr, Kb for the standard (BT.601 or BT.709), Kg = 1 - Kr - Kb
+ * 2. For each pixel:
+ *    - Y  = Kr * R + Kg * G + Kb * B
+ *    - Cb = (B - Y) / (2 * (1 - Kb)) + mid
+ *    - Cr = (R - Y) / (2 * (1 - Kr)) + mid, where mid = (maxVal + 1) / 2
+ * 3. Return the image with channels (Y, Cb, Cr)
+ */
+Image convertRGBToYCbCr(const Image& input, ColorStandard standard = ColorStandard::BT601) {
+    float kr = standard == ColorStandard::BT601 ? 0.299f : 0.2126f;
+    float kb = standard == ColorStandard::BT601 ? 0.114f : 0.0722f;
+    float kg = 1.0f - kr - kb;
+    int maxVal = input.getMaxVal();
+    float mid = (maxVal + 1) / 2.0f;
+
+    return convertPixels(input, [=](int r, int g, int b, int* out) {
+        float luma = kr * r + kg * g + kb * b;
+        out[0] = toSample(luma, maxVal);
+        out[1] = toSample((b - luma) / (2.0f * (1.0f - kb)) + mid, maxVal);
+        out[2] = toSample((r - luma) / (2.0f * (1.0f - kr)) + mid, maxVal);
+    });
+}
+
+/**
+ * Converts full-range YCbCr back to RGB
+ *
+ * Steps:
+ * 1. For each pixel:
+ *    - R = Y + 2 * (1 - Kr) * (Cr - mid)
+ *    - B = Y + 2 * (1 - Kb) * (Cb - mid)
+ *    - G = (Y - Kr * R - Kb * B) / Kg
+ * 2. Return the RGB image
+ */
+Image convertYCbCrToRGB(const Image& input, ColorStandard standard = ColorStandard::BT601) {
+    float kr = standard == ColorStandard::BT601 ? 0.299f : 0.2126f;
+    float kb = standard == ColorStandard::BT601 ? 0.114f : 0.0722f;
+    float kg = 1.0f - kr - kb;
+    int maxVal = input.getMaxVal();
+    float mid = (maxVal + 1) / 2.0f;
+
+    return convertPixels(input, [=](int luma, int cb, int cr, int* out) {
+        float r = luma + 2.0f * (1.0f - kr) * (cr - mid);
+        float b = luma + 2.0f * (1.0f - kb) * (cb - mid);
+        float g = (luma - kr * r - kb * b) / kg;
+        out[0] = toSample(r, maxVal);
+        out[1] = toSample(g, maxVal);
+        out[2] = toSample(b, maxVal);
+    });
+}
+
+// Hue in degrees [0, 360) of an RGB triple with the given max, min and range
+float hueOf(float r, float g, float b, float high, float range) {
+    if (range <= 0) return 0.0f;
+    float hue;
+    if (high == r) hue = 60.0f * (g - b) / range;
+    else if (high == g) hue = 60.0f * (b - r) / range + 120.0f;
+    else hue = 60.0f * (r - g) / range + 240.0f;
+    return hue < 0 ? hue + 360.0f : hue;
+}
+
+// RGB triple (scaled to maxVal) for a hue in degrees, chroma and offset, all in [0, 1] units
+void rgbFromHue(float hue, float chroma, float offset, int maxVal, int* out) {
+    float h = hue / 60.0f;
+    float second = chroma * (1.0f - fabs(fmod(h, 2.0f) - 1.0f));
+    float r = 0, g = 0, b = 0;
+    if (h < 1) { r = chroma; g = second; }
+    else if (h < 2) { r = second; g = chroma; }
+    else if (h < 3) { g = chroma; b = second; }
+    else if (h < 4) { g = second; b = chroma; }
+    else if (h < 5) { r = second; b = chroma; }
+    else { r = chroma; b = second; }
+    out[0] = toSample((r + offset) * maxVal, maxVal);
+    out[1] = toSample((g + offset) * maxVal, maxVal);
+    out[2] = toSample((b + offset) * maxVal, maxVal);
+}
+
+/**
+ * Converts RGB to HSV
+ *
+ * Steps:
+ * 1. For each pixel, with R, G, B scaled to [0, 1]:
+ *    - V = max(R, G, B), chroma = V - min(R, G, B)
+ *    - S = chroma / V (0 for black)
+ *    - H = hue angle of the dominant channel, in degrees
+ * 2. Return the image with channels (H in [0, 359], S and V in [0, maxVal])
+ */
+Image convertRGBToHSV(const Image& input) {
+    int maxVal = input.getMaxVal();
+    return convertPixels(input, [=](int r, int g, int b, int* out) {
+        float high = static_cast<float>(max(r, max(g, b)));
+        float range = high - min(r, min(g, b));
+        out[0] = static_cast<int>(floor(hueOf(static_cast<float>(r), static_cast<float>(g), static_cast<float>(b), high, range) + 0.5f)) % 360;
+        out[1] = high > 0 ? toSample(range / high * maxVal, maxVal) : 0;
+        out[2] = static_cast<int>(high);
+    });
+}
+
+// Converts HSV (as produced by convertRGBToHSV) back to RGB
+Image convertHSVToRGB(const Image& input) {
+    int maxVal = input.getMaxVal();
+    return convertPixels(input, [=](int h, int s, int v, int* out) {
+        float value = static_cast<float>(v) / maxVal;
+        float chroma = value * s / maxVal;
+        rgbFromHue(static_cast<float>(((h % 360) + 360) % 360), chroma, value - chroma, maxVal, out);
+    });
+}
+
+/**
+ * Converts RGB to HSL
+ *
+ * Steps:
+ * 1. For each pixel, with R, G, B scaled to [0, 1]:
+ *    - L = (max + min) / 2, chroma = max - min
+ *    - S = chroma / (1 - |2L - 1|) (0 for grays)
+ *    - H = hue angle, as for HSV
+ * 2. Return the image with channels (H in [0, 359], S and L in [0, maxVal])
+ */
+Image convertRGBToHSL(const Image& input) {
+    int maxVal = input.getMaxVal();
+    return convertPixels(input, [=](int r, int g, int b, int* out) {
+        float high = static_cast<float>(max(r, max(g, b)));
+        float low = static_cast<float>(min(r, min(g, b)));
+        float range = high - low;
+        float lightness = (high + low) / (2.0f * maxVal);
+        float denominator = 1.0f - fabs(2.0f * lightness - 1.0f);
+        out[0] = static_cast<int>(floor(hueOf(static_cast<float>(r), static_cast<float>(g), static_cast<float>(b), high, range) + 0.5f)) % 360;
+        out[1] = denominator > 0 ? toSample(range / maxVal / denominator * maxVal, maxVal) : 0;
+        out[2] = toSample(lightness * maxVal, maxVal);
+    });
+}
+
+// Converts HSL (as produced by convertRGBToHSL) back to RGB
+Image convertHSLToRGB(const Image& input) {
+    int maxVal = input.getMaxVal();
+    return convertPixels(input, [=](int h, int s, int l, int* out) {
+        float lightness = static_cast<float>(l) / maxVal;
+        float chroma = (1.0f - fabs(2.0f * lightness - 1.0f)) * s / maxVal;
+        rgbFromHue(static_cast<float>(((h % 360) + 360) % 360), chroma, lightness - chroma / 2.0f, maxVal, out);
+    });
+}
+
+// Decoding table: sRGB sample in [0, maxVal] -> linear light in [0, 1]
+vector<float> buildSRGBDecodeTable(int maxVal) {
+    vector<float> table(maxVal + 1);
+    for (int v = 0; v <= maxVal; v++) {
+        float c = static_cast<float>(v) / maxVal;
+        table[v] = c <= 0.04045f ? c / 12.92f : pow((c + 0.055f) / 1.055f, 2.4f);
+    }
+    return table;
+}
+
+// Samples a smooth function f on [0, range] at size + 1 points, for interpolated lookup
+struct CurveTable {
+    float range = 1.0f;
+    vector<float> values;
+
+    template <typename F>
+    CurveTable(float r, int size, F f) : range(r), values(size + 1) {
+        for (int i = 0; i <= size; i++) {
+            values[i] = f(range * i / size);
+        }
+    }
+
+    float operator()(float t) const {
+        float position = max(0.0f, t) / range * (values.size() - 1);
+        size_t i = static_cast<size_t>(position);
+        if (i >= values.size() - 1) return values.back();
+        float w = position - i;
+        return values[i] + w * (values[i + 1] - values[i]);
+    }
+};
+
+// sRGB transfer function: linear light in [0, 1] -> encoded value in [0, 1]
+float encodeSRGB(float c) {
+    return c <= 0.0031308f ? 12.92f * c : 1.055f * pow(c, 1.0f / 2.4f) - 0.055f;
+}
+
+// Lab companding function f(t)
+float labForward(float t) {
+    return t > 0.008856f ? cbrt(t) : 7.787f * t + 16.0f / 116.0f;
+}
+
+/**
+ * Converts sRGB to CIE Lab (D65 white point)
+ *
+ * Steps:
+ * 1. Decode sRGB to linear light with a lookup table
+ * 2. Convert linear RGB to XYZ and divide by the white point
+ * 3. Apply the cube-root companding through an interpolated lookup table
+ * 4. L = 116 * fy - 16, a = 500 * (fx - fy), b = 200 * (fy - fz)
+ * 5. Return the image with channels scaled like 8-bit Lab:
+ *    L * maxVal / 100, and a, b scaled by (maxVal + 1) / 256 around mid = (maxVal + 1) / 2
+ */
+Image convertRGBToLab(const Image& input) {
+    int maxVal = input.getMaxVal();
+    float mid = (maxVal + 1) / 2.0f;
+    float scale = (maxVal + 1) / 256.0f;
+    vector<float> decode = buildSRGBDecodeTable(maxVal);
+    CurveTable cubeRoot(1.1f, 4096, labForward);
+
+    return convertPixels(input, [&](int r, int g, int b, int* out) {
+        float lr = decode[max(0, min(maxVal, r))];
+        float lg = decode[max(0, min(maxVal, g))];
+        float lb = decode[max(0, min(maxVal, b))];
+        float fx = cubeRoot((0.4124564f * lr + 0.3575761f * lg + 0.1804375f * lb) / 0.95047f);
+        float fy = cubeRoot(0.2126729f * lr + 0.7151522f * lg + 0.0721750f * lb);
+        float fz = cubeRoot((0.0193339f * lr + 0.1191920f * lg + 0.9503041f * lb) / 1.08883f);
+        out[0] = toSample((116.0f * fy - 16.0f) * maxVal / 100.0f, maxVal);
+        out[1] = toSample(500.0f * (fx - fy) * scale + mid, maxVal);
+        out[2] = toSample(200.0f * (fy - fz) * scale + mid, maxVal);
+    });
+}
+
+/**
+ * Converts CIE Lab (as produced by convertRGBToLab) back to sRGB
+ *
+ * Steps:
+ * 1. fy = (L + 16) / 116, fx = fy + a / 500, fz = fy - b / 200
+ * 2. Invert the companding and multiply by the white point to get XYZ
+ * 3. Convert XYZ to linear RGB
+ * 4. Encode to sRGB through an interpolated lookup table
+ * 5. Return the RGB image
+ */
+Image convertLabToRGB(const Image& input) {
+    int maxVal = input.getMaxVal();
+    float mid = (maxVal + 1) / 2.0f;
+    float scale = (maxVal + 1) / 256.0f;
+    CurveTable encode(1.0f, 4096, encodeSRGB);
+
+    return convertPixels(input, [&](int l, int a, int b, int* out) {
+        float fy = (l * 100.0f / maxVal + 16.0f) / 116.0f;
+        float fx = fy + (a - mid) / scale / 500.0f;
+        float fz = fy - (b - mid) / scale / 200.0f;
+        float x = 0.95047f * (fx * fx * fx > 0.008856f ? fx * fx * fx : (fx - 16.0f / 116.0f) / 7.787f);
+        float y = fy * fy * fy > 0.008856f ? fy * fy * fy : (fy - 16.0f / 116.0f) / 7.787f;
+        float z = 1.08883f * (fz * fz * fz > 0.008856f ? fz * fz * fz : (fz - 16.0f / 116.0f) / 7.787f);
+        out[0] = toSample(encode(3.2404542f * x - 1.5371385f * y - 0.4985314f * z) * maxVal, maxVal);
+        out[1] = toSample(encode(-0.9692660f * x + 1.8760108f * y + 0.0415560f * z) * maxVal, maxVal);
+        out[2] = toSample(encode(0.0556434f * x - 0.2040259f * y + 1.0572252f * z) * maxVal, maxVal);
+    });
+}
+
+/**
+ * Shifts hue and scales saturation
+ *
+ * Steps:
+ * 1. Convert the image to HSV
+ * 2. For each pixel: add hueShift degrees to H (wrapping) and multiply S by factor
+ * 3. Convert back to RGB and return
+ */
+Image adjustHueSaturation(const Image& input, int hueShift, float saturationFactor) {
+    Image hsv = convertRGBToHSV(input);
+    int maxVal = hsv.getMaxVal();
+    int height = hsv.getHeight();
+    int width = hsv.getWidth();
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                hsv(y, x, 0) = ((hsv(y, x, 0) + hueShift) % 360 + 360) % 360;
+                hsv(y, x, 1) = toSample(hsv(y, x, 1) * saturationFactor, maxVal);
+            }
+        }
+    });
+
+    return convertHSVToRGB(hsv);
+}
+
+// Chroma subsampling layouts for planar YUV images
+enum class ChromaFormat { YUV420, YUV422 };
+
+// Class to represent a planar YCbCr image with subsampled chroma
+// 4:2:0 halves chroma in both directions, 4:2:2 only horizontally
+class YUVImage {
+private:
+    int width, height, maxVal, chromaWidth, chromaHeight;
+    ChromaFormat format;
+    vector<int> lumaPlane;  // [y * width + x]
+    vector<int> cbPlane;    // [y * chromaWidth + x]
+    vector<int> crPlane;
+
+public:
+    // Default constructor
+    YUVImage() {
+        width = 0;
+        height = 0;
+        maxVal = 255;
+        chromaWidth = 0;
+        chromaHeight = 0;
+        format = ChromaFormat::YUV420;
+    }
+
+    // Create blank image (black luma, neutral chroma)
+    YUVImage(int w, int h, ChromaFormat f = ChromaFormat::YUV420, int maxValue = 255) {
+        width = w;
+        height = h;
+        maxVal = maxValue;
+        format = f;
+        chromaWidth = (w + 1) / 2;
+        chromaHeight = f == ChromaFormat::YUV420 ? (h + 1) / 2 : h;
+        lumaPlane.assign(static_cast<size_t>(width) * height, 0);
+        cbPlane.assign(static_cast<size_t>(chromaWidth) * chromaHeight, (maxVal + 1) / 2);
+        crPlane.assign(static_cast<size_t>(chromaWidth) * chromaHeight, (maxVal + 1) / 2);
+    }
+
+    // Get image dimensions
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    int getMaxVal() const { return maxVal; }
+    int getChromaWidth() const { return chromaWidth; }
+    int getChromaHeight() const { return chromaHeight; }
+    ChromaFormat getFormat() const { return format; }
+
+    // Sample access; chroma coordinates are in the subsampled grid
+    int& luma(int y, int x) { return lumaPlane[static_cast<size_t>(y) * width + x]; }
+    const int& luma(int y, int x) const { return lumaPlane[static_cast<size_t>(y) * width + x]; }
+    int& cb(int y, int x) { return cbPlane[static_cast<size_t>(y) * chromaWidth + x]; }
+    const int& cb(int y, int x) const { return cbPlane[static_cast<size_t>(y) * chromaWidth + x]; }
+    int& cr(int y, int x) { return crPlane[static_cast<size_t>(y) * chromaWidth + x]; }
+    const int& cr(int y, int x) const { return crPlane[static_cast<size_t>(y) * chromaWidth + x]; }
+
+    // Chroma row covering a given luma row
+    int chromaRow(int y) const { return format == ChromaFormat::YUV420 ? y / 2 : y; }
+};
+
+/**
+ * Converts an RGB image to planar YUV with subsampled chroma
+ *
+ * Steps:
+ * 1. Create a YUV image with the requested chroma format
+ * 2. For each chroma sample (chroma rows processed in parallel bands):
+ *    - Convert each covered RGB pixel (2x2 for 4:2:0, 2x1 for 4:2:2) to Y, Cb, Cr
+ *    - Store every Y at full resolution
+ *    - Store the average Cb and Cr of the covered pixels
+ * 3. Return the YUV image
+ */
+YUVImage convertToYUV(const Image& input, ChromaFormat format = ChromaFormat::YUV420,
+                      ColorStandard standard = ColorStandard::BT601) {
+    int height = input.getHeight();
+    int width = input.getWidth();
+    int maxVal = input.getMaxVal();
+    YUVImage output(width, height, format, maxVal);
+    bool gray = input.getChannels() < 3;
+
+    float kr = standard == ColorStandard::BT601 ? 0.299f : 0.2126f;
+    float kb = standard == ColorStandard::BT601 ? 0.114f : 0.0722f;
+    float kg = 1.0f - kr - kb;
+    float mid = (maxVal + 1) / 2.0f;
+    int rowsPerChroma = format == ChromaFormat::YUV420 ? 2 : 1;
+
+    parallelFor(0, output.getChromaHeight(), [&](int cy0, int cy1) {
+        for (int cy = cy0; cy < cy1; cy++) {
+            for (int cx = 0; cx < output.getChromaWidth(); cx++) {
+                float sumCb = 0, sumCr = 0;
+                int count = 0;
+                for (int y = cy * rowsPerChroma; y < min(height, (cy + 1) * rowsPerChroma); y++) {
+                    for (int x = cx * 2; x < min(width, cx * 2 + 2); x++) {
+                        int r = input(y, x, 0);
+                        int g = gray ? r : input(y, x, 1);
+                        int b = gray ? r : input(y, x, 2);
+                        float luma = kr * r + kg * g + kb * b;
+                        output.luma(y, x) = toSample(luma, maxVal);
+                        sumCb += (b - luma) / (2.0f * (1.0f - kb));
+                        sumCr += (r - luma) / (2.0f * (1.0f - kr));
+                        count++;
+                    }
+                }
+                output.cb(cy, cx) = toSample(sumCb / count + mid, maxVal);
+                output.cr(cy, cx) = toSample(sumCr / count + mid, maxVal);
+            }
+        }
+    });
+
+    return output;
+}
+
+/**
+ * Converts a planar YUV image back to RGB
+ *
+ * Steps:
+ * 1. Create a 3-channel image with the same dimensions
+ * 2. For each pixel (rows processed in parallel bands):
+ *    - Take Y at full resolution and Cb, Cr from the covering chroma sample
+ *    - Convert to R, G, B with the YCbCr equations of the chosen standard
+ * 3. Return the RGB image
+ */
+Image convertFromYUV(const YUVImage& input, ColorStandard standard = ColorStandard::BT601) {
+    int height = input.getHeight();
+    int width = input.getWidth();
+    int maxVal = input.getMaxVal();
+    Image output(width, height, 3);
+    output.setMaxVal(maxVal);
+
+    float kr = standard == ColorStandard::BT601 ? 0.299f : 0.2126f;
+    float kb = standard == ColorStandard::BT601 ? 0.114f : 0.0722f;
+    float kg = 1.0f - kr - kb;
+    float mid = (maxVal + 1) / 2.0f;
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            int cy = input.chromaRow(y);
+            for (int x = 0; x < width; x++) {
+                float luma = static_cast<float>(input.luma(y, x));
+                float r = luma + 2.0f * (1.0f - kr) * (input.cr(cy, x / 2) - mid);
+                float b = luma + 2.0f * (1.0f - kb) * (input.cb(cy, x / 2) - mid);
+                float g = (luma - kr * r - kb * b) / kg;
+                output(y, x, 0) = toSample(r, maxVal);
+                output(y, x, 1) = toSample(g, maxVal);
+                output(y, x, 2) = toSample(b, maxVal);
+            }
+        }
+    });
+
+    return output;
+}
+
+// Copies the luma plane into a single-channel image
+Image lumaToImage(const YUVImage& input) {
+    int height = input.getHeight();
+    int width = input.getWidth();
+    Image output(width, height, 1);
+    output.setMaxVal(input.getMaxVal());
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                output(y, x, 0) = input.luma(y, x);
+            }
+        }
+    });
+
+    return output;
+}
+
+/**
+ * Applies the 3x3 blur to the luma plane only
+ *
+ * Steps:
+ * 1. Copy the input image (chroma is kept as is)
+ * 2. For each luma sample (excluding borders, which are set to 0 as in applyBlur):
+ *    - Set it to the average of its 3x3 neighborhood
+ * 3. Return the blurred image
+ */
+YUVImage applyBlur(const YUVImage& input) {
+    YUVImage output = input;
+    int height = input.getHeight();
+    int width = input.getWidth();
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                if (y == 0 || y == height - 1 || x == 0 || x == width - 1) {
+                    output.luma(y, x) = 0;
+                    continue;
+                }
+                int sum = 0;
+                for (int ky = -1; ky <= 1; ky++) {
+                    for (int kx = -1; kx <= 1; kx++) {
+                        sum += input.luma(y + ky, x + kx);
+                    }
+                }
+                output.luma(y, x) = sum / 9;
+            }
+        }
+    });
+
+    return output;
+}
+
+/**
+ * Adjusts contrast on the luma plane only
+ *
+ * Steps:
+ * 1. Copy the input image (chroma is kept as is)
+ * 2. For each luma sample:
+ *    - new_value = factor * (value - mid) + mid, with mid = (maxVal + 1) / 2
+ *    - Clamp between 0 and maxVal
+ * 3. Return the adjusted image
+ */
+YUVImage adjustContrast(const YUVImage& input, float factor) {
+    YUVImage output = input;
+    int height = input.getHeight();
+    int width = input.getWidth();
+    int maxVal = input.getMaxVal();
+    float mid = (maxVal + 1) / 2.0f;
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                output.luma(y, x) = toSample(factor * (input.luma(y, x) - mid) + mid, maxVal);
+            }
+        }
+    });
+
+    return output;
+}
+
+// Runs Canny edge detection on the luma plane
+Image detectEdgesCanny(const YUVImage& input, float lowThreshold, float highThreshold) {
+    return detectEdgesCanny(lumaToImage(input), lowThreshold, highThreshold);
+}
+
+/**
+ * Converts an 8-bit sRGB image to 16-bit linear light
+ *
+ * Steps:
+ * 1. Build a table decoding each sRGB value to linear light in [0, 1]
+ * 2. Scale the table to [0, 65535]
+ * 3. Apply it to every channel and mark the result as 16-bit
+ */
+Image convertToLinear(const Image& input) {
+    vector<float> decode = buildSRGBDecodeTable(input.getMaxVal());
+    vector<int> lut(decode.size());
+    for (size_t v = 0; v < decode.size(); v++) {
+        lut[v] = toSample(decode[v] * 65535.0f, 65535);
+    }
+
+    Image output = applyLUT(input, lut);
+    output.setMaxVal(65535);
+    return output;
+}
+
+/**
+ * Converts a linear-light image back to sRGB
+ *
+ * Steps:
+ * 1. Build a table encoding each linear value (0 to the input maxVal) to sRGB in [0, maxVal]
+ * 2. Apply it to every channel and mark the result with the output maxVal
+ */
+Image convertToSRGB(const Image& input, int maxVal = 255) {
+    int inputMax = input.getMaxVal();
+    vector<int> lut(inputMax + 1);
+    for (int v = 0; v <= inputMax; v++) {
+        lut[v] = toSample(encodeSRGB(static_cast<float>(v) / inputMax) * maxVal, maxVal);
+    }
+
+    Image output = applyLUT(input, lut);
+    output.setMaxVal(maxVal);
+    return output;
+}
+
+// Loads a P3 PPM image and converts it to 16-bit linear light for accurate processing
+bool loadPPMLinear(Image& img, const string& filename) {
+    if (!img.loadPPM(filename)) return false;
+    img = convertToLinear(img);
+    return true;
+}
+
+// Re-encodes a linear-light image to 8-bit sRGB and saves it as a P3 PPM image
+bool savePPMLinear(const Image& img, const string& filename) {
+    return convertToSRGB(img).savePPM(filename);
+}
+
+// Smallest gamma accepted by adjustGamma and adjustLevels
+const float minGamma = 0.01f;
+
+/**
+ * Applies a gamma curve
+ *
+ * Steps:
+ * 1. Clamp gamma to at least minGamma (zero, negative or NaN would give inf/NaN samples)
+ * 2. Build a table: lut[v] = maxVal * (v / maxVal) ^ (1 / gamma)
+ * 3. Apply it to every channel and return the result
+ */
+Image adjustGamma(const Image& input, float gamma) {
+    gamma = max(minGamma, gamma);
+    int maxVal = input.getMaxVal();
+    vector<int> lut(maxVal + 1);
+    for (int v = 0; v <= maxVal; v++) {
+        lut[v] = toSample(pow(static_cast<float>(v) / maxVal, 1.0f / gamma) * maxVal, maxVal);
+    }
+    return applyLUT(input, lut);
+}
+
+/**
+ * Remaps input levels to output levels with a midtone gamma
+ *
+ * Steps:
+ * 1. Build a table for each value v:
+ *    - t = (v - inputBlack) / (inputWhite - inputBlack), clamped to [0, 1]
+ *    - t = t ^ (1 / gamma), with gamma clamped to at least minGamma
+ *    - lut[v] = outputBlack + t * (outputWhite - outputBlack)
+ * 2. Apply it to every channel and return the result
+ */
+Image adjustLevels(const Image& input, int inputBlack, int inputWhite, float gamma = 1.0f,
+                   int outputBlack = 0, int outputWhite = -1) {
+    gamma = max(minGamma, gamma);
+    int maxVal = input.getMaxVal();
+    if (outputWhite < 0) outputWhite = maxVal;
+    float range = static_cast<float>(max(1, inputWhite - inputBlack));
+
+    vector<int> lut(maxVal + 1);
+    for (int v = 0; v <= maxVal; v++) {
+        float t = max(0.0f, min(1.0f, (v - inputBlack) / range));
+        t = pow(t, 1.0f / gamma);
+        lut[v] = toSample(outputBlack + t * (outputWhite - outputBlack), maxVal);
+    }
+    return applyLUT(input, lut);
+}
+
+/**
+ * Compiles a tone curve into a lookup table
+ *
+ * Steps:
+ * 1. Sort the control points (x, y), both in [0, 1]
+ * 2. For each value v, interpolate linearly between the two control points around v / maxVal
+ *    (values outside the first and last point take their y)
+ * 3. Return the table scaled to [0, maxVal]
+ */
+vector<int> buildToneCurve(vector<pair<float, float>> points, int maxVal) {
+    vector<int> lut(maxVal + 1);
+    if (points.empty()) {
+        for (int v = 0; v <= maxVal; v++) lut[v] = v;
+        return lut;
+    }
+    sort(points.begin(), points.end());
+
+    size_t segment = 0;
+    for (int v = 0; v <= maxVal; v++) {
+        float t = static_cast<float>(v) / maxVal;
+        while (segment + 1 < points.size() && points[segment + 1].first < t) segment++;
+
+        float value;
+        if (t <= points.front().first) value = points.front().second;
+        else if (segment + 1 >= points.size()) value = points.back().second;
+        else {
+            const pair<float, float>& a = points[segment];
+            const pair<float, float>& b = points[segment + 1];
+            float span = b.first - a.first;
+            value = span > 0 ? a.second + (t - a.first) / span * (b.second - a.second) : b.second;
+        }
+        lut[v] = toSample(value * maxVal, maxVal);
+    }
+    return lut;
+}
+
+// Applies a tone curve given as (input, output) control points in [0, 1]
+Image applyToneCurve(const Image& input, const vector<pair<float, float>>& points) {
+    return applyLUT(input, buildToneCurve(points, input.getMaxVal()));
+}
+
+// Porter-Duff and separable blend modes for compositing premultiplied images
+enum class BlendMode { Over, Multiply, Screen, Add };
+
+// Adds an opaque (or constant) alpha channel to an RGB or grayscale image
+Image addAlphaChannel(const Image& input, int alpha = -1) {
+    int height = input.getHeight();
+    int width = input.getWidth();
+    int channels = input.getChannels();
+    int maxVal = input.getMaxVal();
+    if (alpha < 0) alpha = maxVal;
+    Image output(width, height, channels + 1);
+    output.setMaxVal(maxVal);
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < channels; c++) {
+                    output(y, x, c) = input(y, x, c);
+                }
+                output(y, x, channels) = alpha;
+            }
+        }
+    });
+
+    return output;
+}
+
+/**
+ * Converts straight alpha to premultiplied alpha
+ *
+ * Steps:
+ * 1. The last channel is alpha (2 or 4 channel images)
+ * 2. For each pixel: color = color * alpha / maxVal, using a 16-bit fixed-point
+ *    alpha factor (alpha * 65536 / maxVal) and a shift instead of a division
+ * 3. Return the premultiplied image
+ */
+Image premultiplyAlpha(const Image& input) {
+    int height = input.getHeight();
+    int width = input.getWidth();
+    int channels = input.getChannels();
+    int maxVal = input.getMaxVal();
+    Image output = input;
+    if (channels != 2 && channels != 4) return output;
+    int alphaChannel = channels - 1;
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                uint32_t factor = static_cast<uint32_t>((static_cast<uint64_t>(input(y, x, alphaChannel)) * 65536 + maxVal / 2) / maxVal);
+                for (int c = 0; c < alphaChannel; c++) {
+                    output(y, x, c) = static_cast<int>((static_cast<uint32_t>(input(y, x, c)) * factor + 32768) >> 16);
+                }
+            }
+        }
+    });
+
+    return output;
+}
+
+/**
+ * Converts premultiplied alpha back to straight alpha
+ *
+ * Steps:
+ * 1. For each pixel with non-zero alpha: color = color * maxVal / alpha
+ * 2. Fully transparent pixels become black
+ * 3. Return the straight-alpha image
+ */
+Image unpremultiplyAlpha(const Image& input) {
+    int height = input.getHeight();
+    int width = input.getWidth();
+    int channels = input.getChannels();
+    int maxVal = input.getMaxVal();
+    Image output = input;
+    if (channels != 2 && channels != 4) return output;
+    int alphaChannel = channels - 1;
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                int alpha = input(y, x, alphaChannel);
+                for (int c = 0; c < alphaChannel; c++) {
+                    output(y, x, c) = alpha > 0 ? static_cast<int>(min<long long>(maxVal, (static_cast<long long>(input(y, x, c)) * maxVal + alpha / 2) / alpha)) : 0;
+                }
+            }
+        }
+    });
+
+    return output;
+}
+
+/**
+ * Composites a premultiplied RGBA overlay onto a background
+ *
+ * Steps:
+ * 1. Clip the overlay placed at (offsetX, offsetY) to the background
+ * 2. For each covered pixel (rows processed in parallel bands), with S the overlay,
+ *    D the background (opaque if it has no alpha channel) and values in [0, 1]:
+ *    - Over:     out = S + D * (1 - Sa)
+ *    - Multiply: out = S * D + S * (1 - Da) + D * (1 - Sa)
+ *    - Screen:   out = S + D - S * D
+ *    - Add:      out = min(1, S + D)
+ *    - alpha     = Sa + Da * (1 - Sa) (Add: min(1, Sa + Da))
+ *    Products use 16-bit fixed-point factors (x * 65536 / maxVal) and shifts
+ * 3. Return the composited image (same channels as the background; a premultiplied
+ *    background stays premultiplied)
+ */
+Image compositeImages(const Image& background, const Image& overlay, int offsetX = 0, int offsetY = 0,
+                      BlendMode mode = BlendMode::Over) {
+    Image output = background;
+    int maxVal = background.getMaxVal();
+    int colorChannels = min(3, background.getChannels());
+    bool backgroundAlpha = background.getChannels() == 2 || background.getChannels() == 4;
+    int overlayAlpha = overlay.getChannels() - 1;
+    bool grayOverlay = overlay.getChannels() < 3;
+    if (overlay.getChannels() != 2 && overlay.getChannels() != 4) {
+        cerr << "Error: Overlay must have an alpha channel" << endl;
+        return output;
+    }
+
+    int x0 = max(0, offsetX), y0 = max(0, offsetY);
+    int x1 = min(background.getWidth(), offsetX + overlay.getWidth());
+    int y1 = min(background.getHeight(), offsetY + overlay.getHeight());
+    if (x0 >= x1 || y0 >= y1) return output;
+
+    auto toFixed = [maxVal](int v) { return static_cast<uint32_t>((static_cast<uint64_t>(v) * 65536 + maxVal / 2) / maxVal); };
+    auto mul = [](uint32_t value, uint32_t fixedFactor) { return static_cast<int>((static_cast<uint64_t>(value) * fixedFactor + 32768) >> 16); };
+
+    parallelFor(y0, y1, [&](int rowBegin, int rowEnd) {
+        for (int y = rowBegin; y < rowEnd; y++) {
+            for (int x = x0; x < x1; x++) {
+                int oy = y - offsetY, ox = x - offsetX;
+                int sa = overlay(oy, ox, overlayAlpha);
+                int da = backgroundAlpha ? background(y, x, background.getChannels() - 1) : maxVal;
+                uint32_t inverseSa = 65536 - toFixed(sa);
+                uint32_t inverseDa = 65536 - toFixed(da);
+
+                for (int c = 0; c < colorChannels; c++) {
+                    int s = overlay(oy, ox, grayOverlay ? 0 : c);
+                    int d = background(y, x, c);
+                    int result;
+                    switch (mode) {
+                    case BlendMode::Multiply:
+                        result = mul(s, toFixed(d)) + mul(s, inverseDa) + mul(d, inverseSa);
+                        break;
+                    case BlendMode::Screen:
+                        result = s + d - mul(s, toFixed(d));
+                        break;
+                    case BlendMode::Add:
+                        result = s + d;
+                        break;
+                    default:
+                        result = s + mul(d, inverseSa);
+                        break;
+                    }
+                    output(y, x, c) = min(maxVal, result);
+                }
+
+                if (backgroundAlpha) {
+                    int alpha = mode == BlendMode::Add ? sa + da : sa + mul(da, inverseSa);
+                    output(y, x, background.getChannels() - 1) = min(maxVal, alpha);
+                }
+            }
+        }
+    });
+
+    return output;
+}
+
+// Source columns, rows and weights for bilinear resizing between two fixed sizes
+struct ResizePlan {
+    int sourceWidth = 0, sourceHeight = 0, targetWidth = 0, targetHeight = 0;
+    vector<int> x0, x1, y0, y1;
+    vector<float> wx, wy;
+};
+
+// Maps every output column and row center back to the two nearest source samples
+ResizePlan planResize(int sourceWidth, int sourceHeight, int targetWidth, int targetHeight) {
+    ResizePlan plan;
+    plan.sourceWidth = sourceWidth;
+    plan.sourceHeight = sourceHeight;
+    plan.targetWidth = targetWidth;
+    plan.targetHeight = targetHeight;
+    if (sourceWidth == 0 || sourceHeight == 0) return plan;
+
+    auto buildAxis = [](int source, int target, vector<int>& i0, vector<int>& i1, vector<float>& weight) {
+        float scale = static_cast<float>(source) / target;
+        for (int i = 0; i < target; i++) {
+            float f = max(0.0f, (i + 0.5f) * scale - 0.5f);
+            int s0 = min(source - 1, static_cast<int>(f));
+            i0.push_back(s0);
+            i1.push_back(min(source - 1, s0 + 1));
+            weight.push_back(f - s0);
+        }
+    };
+    buildAxis(sourceWidth, targetWidth, plan.x0, plan.x1, plan.wx);
+    buildAxis(sourceHeight, targetHeight, plan.y0, plan.y1, plan.wy);
+    return plan;
+}
+
+/**
+ * Resizes an image with bilinear interpolation using a precomputed plan
+ *
+ * Steps:
+ * 1. Shape output to the plan's target size (its storage is reused when it already matches)
+ * 2. For each output pixel (rows processed in parallel bands), blend the four source
+ *    pixels the plan gives for its column and row by their distances
+ */
+void resizeImage(const Image& input, const ResizePlan& plan, Image& output) {
+    int channels = input.getChannels();
+    reshapeImage(output, plan.targetWidth, plan.targetHeight, channels, input.getMaxVal());
+    if (input.getWidth() != plan.sourceWidth || input.getHeight() != plan.sourceHeight) {
+        cerr << "Error: Image size does not match the resize plan" << endl;
+        return;
+    }
+    if (plan.sourceWidth == 0 || plan.sourceHeight == 0) return;
+
+    parallelFor(0, plan.targetHeight, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            int sy0 = plan.y0[y], sy1 = plan.y1[y];
+            float wy = plan.wy[y];
+            for (int x = 0; x < plan.targetWidth; x++) {
+                int sx0 = plan.x0[x], sx1 = plan.x1[x];
+                float wx = plan.wx[x];
+                for (int c = 0; c < channels; c++) {
+                    float top = input(sy0, sx0, c) + wx * (input(sy0, sx1, c) - input(sy0, sx0, c));
+                    float bottom = input(sy1, sx0, c) + wx * (input(sy1, sx1, c) - input(sy1, sx0, c));
+                    output(y, x, c) = static_cast<int>(top + wy * (bottom - top) + 0.5f);
+                }
+            }
+        }
+    });
+}
+
+// Resizes an image with bilinear interpolation
+Image resizeImage(const Image& input, int newWidth, int newHeight) {
+    Image output;
+    resizeImage(input, planResize(input.getWidth(), input.getHeight(), newWidth, newHeight), output);
+    return output;
+}
+
+// Watermark overlay prepared once and reused for every image it is stamped on
+// The overlay is premultiplied on construction and resized once per target size
+class OverlayCache {
+private:
+    Image overlay;        // premultiplied RGBA
+    float relativeWidth;  // overlay width as a fraction of the target width
+    int margin;           // distance from the bottom-right corner, in pixels
+    map<pair<int, int>, Image> resized; // keyed by target (width, height)
+    mutex cacheMutex;
+
+public:
+    OverlayCache(const Image& logo, float widthFraction = 0.2f, int marginPixels = 10) {
+        overlay = premultiplyAlpha(logo.getChannels() == 2 || logo.getChannels() == 4 ? logo : addAlphaChannel(logo));
+        relativeWidth = widthFraction;
+        margin = marginPixels;
+    }
+
+    // Overlay scaled for a target image size (computed on first use, then cached)
+    const Image& forSize(int targetWidth, int targetHeight) {
+        lock_guard<mutex> lock(cacheMutex);
+        pair<int, int> key(targetWidth, targetHeight);
+        auto found = resized.find(key);
+        if (found != resized.end()) return found->second;
+
+        int w = max(1, static_cast<int>(targetWidth * relativeWidth + 0.5f));
+        int h = max(1, static_cast<int>(static_cast<long long>(w) * overlay.getHeight() / max(1, overlay.getWidth())));
+        return resized.emplace(key, resizeImage(overlay, w, h)).first->second;
+    }
+
+    int getMargin() const { return margin; }
+};
+
+/**
+ * Stamps a cached watermark onto the bottom-right corner of an image
+ *
+ * Steps:
+ * 1. Get the overlay prepared for the image size (premultiplied and resized once)
+ * 2. Place it margin pixels from the bottom-right corner
+ * 3. Composite it over the image in a single pass over the covered region
+ * 4. Return the watermarked image
+ */
+Image applyWatermark(const Image& input, OverlayCache& cache) {
+    const Image& overlay = cache.forSize(input.getWidth(), input.getHeight());
+    int x = input.getWidth() - overlay.getWidth() - cache.getMargin();
+    int y = input.getHeight() - overlay.getHeight() - cache.getMargin();
+    return compositeImages(input, overlay, x, y, BlendMode::Over);
+}
+
+// File name without its directory
+string baseName(const string& path) {
+    size_t slash = path.find_last_of("/\\");
+    return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+/**
+ * Runs an operation over a batch of PPM files
+ *
+ * Steps:
+ * 1. Split the file list into bands processed in parallel
+ * 2. For each file: load it, apply the operation and save the result
+ *    under outputDirectory with the same file name
+ * 3. Return the number of files processed successfully
+ */
+int processBatch(const vector<string>& inputFiles, const string& outputDirectory,
+                 const function<Image(const Image&)>& operation) {
+    int processed = 0;
+    mutex countMutex;
+
+    parallelFor(0, static_cast<int>(inputFiles.size()), [&](int i0, int i1) {
+        int local = 0;
+        for (int i = i0; i < i1; i++) {
+            Image img;
+            if (!img.loadPPM(inputFiles[i])) continue;
+            if (operation(img).savePPM(outputDirectory + "/" + baseName(inputFiles[i]))) local++;
+        }
+        lock_guard<mutex> lock(countMutex);
+        processed += local;
+    }, 1);
+
+    return processed;
+}
+
+// Stamps the same watermark onto every file of a batch
+int watermarkBatch(const vector<string>& inputFiles, const string& outputDirectory, OverlayCache& cache) {
+    return processBatch(inputFiles, outputDirectory, [&](const Image& img) { return applyWatermark(img, cache); });
+}
+
+// Normalized 1D Gaussian weights for offsets -radius..radius
+vector<float> gaussianKernel(float sigma, int radius) {
+    vector<float> weights(2 * radius + 1);
+    float total = 0;
+    for (int i = -radius; i <= radius; i++) {
+        weights[i + radius] = exp(-(i * i) / (2.0f * sigma * sigma));
+        total += weights[i + radius];
+    }
+    for (float& w : weights) w /= total;
+    return weights;
+}
+
+/**
+ * Sharpens an image with an unsharp mask
+ *
+ * Steps:
+ * 1. Build a Gaussian kernel with sigma = radius (support of 3 sigma)
+ * 2. Split the rows into bands processed in parallel; each band keeps a ring buffer of
+ *    the 2 * support + 1 horizontally blurred rows around the current row
+ * 3. For each output row:
+ *    - Blur the ring buffer rows vertically to get the blurred value
+ *    - diff = original - blurred
+ *    - If |diff| >= threshold: new_value = original + amount * diff, else keep the original
+ *    - Clamp between 0 and maxVal
+ *    (the full blurred image is never stored)
+ * 4. Return the sharpened image
+ */
+Image applyUnsharpMask(const Image& input, float radius = 1.0f, float amount = 1.0f, int threshold = 0) {
+    int height = input.getHeight();
+    int width = input.getWidth();
+    int channels = input.getChannels();
+    int maxVal = input.getMaxVal();
+    Image output(width, height, channels);
+    output.setMaxVal(maxVal);
+    if (width == 0 || height == 0) return output;
+
+    float sigma = max(0.1f, radius);
+    int support = max(1, static_cast<int>(ceil(3.0f * sigma)));
+    vector<float> kernel = gaussianKernel(sigma, support);
+    int ringSize = 2 * support + 1;
+    size_t rowSize = static_cast<size_t>(width) * channels;
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        vector<float> ring(ringSize * rowSize);
+
+        // Horizontally blurred copy of input row sy (clamped) into its ring slot
+        auto blurRow = [&](int sy) {
+            int clampedY = max(0, min(height - 1, sy));
+            float* dst = &ring[static_cast<size_t>(((sy % ringSize) + ringSize) % ringSize) * rowSize];
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < channels; c++) {
+                    float sum = 0;
+                    for (int k = -support; k <= support; k++) {
+                        int sx = max(0, min(width - 1, x + k));
+                        sum += kernel[k + support] * input(clampedY, sx, c);
+                    }
+                    dst[static_cast<size_t>(x) * channels + c] = sum;
+                }
+            }
+        };
+
+        for (int sy = y0 - support; sy < y0 + support; sy++) {
+            blurRow(sy);
+        }
+
+        for (int y = y0; y < y1; y++) {
+            blurRow(y + support);
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < channels; c++) {
+                    float blurred = 0;
+                    for (int k = -support; k <= support; k++) {
+                        int slot = (((y + k) % ringSize) + ringSize) % ringSize;
+                        blurred += kernel[k + support] * ring[slot * rowSize + static_cast<size_t>(x) * channels + c];
+                    }
+                    int original = input(y, x, c);
+                    float diff = original - blurred;
+                    output(y, x, c) = fabs(diff) >= threshold ? toSample(original + amount * diff, maxVal) : original;
+                }
+            }
+        }
+    });
+
+    return output;
+}
+
+/**
+ * Applies a simple 3x3 sharpen filter
+ *
+ * Steps:
+ * 1. Create a new image with the same dimensions as the input
+ * 2. For each pixel and channel (borders are clamped to the nearest pixel):
+ *    - new_value = 5 * center - (up + down + left + right)
+ *    - Clamp between 0 and maxVal
+ * 3. Return the sharpened image
+ */
+Image applySharpen(const Image& input) {
+    int height = input.getHeight();
+    int width = input.getWidth();
+    int channels = input.getChannels();
+    int maxVal = input.getMaxVal();
+    Image output(width, height, channels);
+    output.setMaxVal(maxVal);
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            int up = max(0, y - 1), down = min(height - 1, y + 1);
+            for (int x = 0; x < width; x++) {
+                int left = max(0, x - 1), right = min(width - 1, x + 1);
+                for (int c = 0; c < channels; c++) {
+                    int value = 5 * input(y, x, c) - input(up, x, c) - input(down, x, c)
+                              - input(y, left, c) - input(y, right, c);
+                    output(y, x, c) = max(0, min(maxVal, value));
+                }
+            }
+        }
+    });
+
+    return output;
+}
+
+/**
+ * Applies an exact bilateral filter
+ *
+ * Steps:
+ * 1. Clamp both sigmas to at least 0.1 (zero or negative sigmas would give NaN weights);
+ *    radius = ceil(2 * sigmaSpatial); precompute the spatial weight of every window offset
+ * 2. Precompute the range weight for every possible summed channel difference d:
+ *        exp(-(d / channels)^2 / (2 * sigmaRange^2))
+ * 3. For each pixel (rows processed in parallel bands):
+ *    - For each neighbor in the window, weight = spatial weight * range weight
+ *      of the absolute channel differences to the center
+ *    - new_value = weighted average of the neighbors, per channel
+ * 4. Return the filtered image
+ */
+Image applyBilateralExact(const Image& input, float sigmaSpatial, float sigmaRange) {
+    int height = input.getHeight();
+    int width = input.getWidth();
+    int channels = input.getChannels();
+    int maxVal = input.getMaxVal();
+    Image output(width, height, channels);
+    output.setMaxVal(maxVal);
+
+    sigmaSpatial = max(0.1f, sigmaSpatial);
+    sigmaRange = max(0.1f, sigmaRange);
+    int radius = max(1, static_cast<int>(ceil(2.0f * sigmaSpatial)));
+    int side = 2 * radius + 1;
+    vector<float> spatial(static_cast<size_t>(side) * side);
+    for (int dy = -radius; dy <= radius; dy++) {
+        for (int dx = -radius; dx <= radius; dx++) {
+            spatial[(dy + radius) * side + dx + radius] = exp(-(dx * dx + dy * dy) / (2.0f * sigmaSpatial * sigmaSpatial));
+        }
+    }
+    vector<float> range(static_cast<size_t>(channels) * maxVal + 1);
+    for (size_t d = 0; d < range.size(); d++) {
+        float mean = static_cast<float>(d) / channels;
+        range[d] = exp(-(mean * mean) / (2.0f * sigmaRange * sigmaRange));
+    }
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        vector<float> sums(channels);
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                fill(sums.begin(), sums.end(), 0.0f);
+                float totalWeight = 0;
+                for (int dy = max(-radius, -y); dy <= min(radius, height - 1 - y); dy++) {
+                    for (int dx = max(-radius, -x); dx <= min(radius, width - 1 - x); dx++) {
+                        int difference = 0;
+                        for (int c = 0; c < channels; c++) {
+                            difference += abs(input(y + dy, x + dx, c) - input(y, x, c));
+                        }
+                        float weight = spatial[(dy + radius) * side + dx + radius] * range[min(difference, static_cast<int>(range.size()) - 1)];
+                        totalWeight += weight;
+                        for (int c = 0; c < channels; c++) {
+                            sums[c] += weight * input(y + dy, x + dx, c);
+                        }
+                    }
+                }
+                for (int c = 0; c < channels; c++) {
+                    output(y, x, c) = toSample(sums[c] / totalWeight, maxVal);
+                }
+            }
+        }
+    });
+
+    return output;
+}
+
+/**
+ * Approximates a bilateral filter with a bilateral grid
+ *
+ * Steps:
+ * 1. Create a coarse 3D grid: x / sigmaSpatial, y / sigmaSpatial, luminance / sigmaRange
+ * 2. Splat: accumulate (channel values, 1) of each pixel into its nearest cell; bands
+ *    cover disjoint grid rows, so they write the shared grid without copies or locks
+ * 3. Blur the grid with a [1 2 1] kernel along each of the three axes
+ * 4. Slice: for each pixel, trilinearly interpolate the grid at its position and
+ *    divide the accumulated values by the accumulated weight
+ * 5. Return the filtered image (cost no longer depends on the spatial radius)
+ */
+Image applyBilateralGrid(const Image& input, float sigmaSpatial, float sigmaRange) {
+    int height = input.getHeight();
+    int width = input.getWidth();
+    int channels = input.getChannels();
+    int maxVal = input.getMaxVal();
+    Image output(width, height, channels);
+    output.setMaxVal(maxVal);
+    if (width == 0 || height == 0) return output;
+
+    const int pad = 2;
+    sigmaSpatial = max(1.0f, sigmaSpatial);
+    sigmaRange = max(1.0f, sigmaRange);
+    int gridW = static_cast<int>((width - 1) / sigmaSpatial) + 1 + 2 * pad;
+    int gridH = static_cast<int>((height - 1) / sigmaSpatial) + 1 + 2 * pad;
+    int gridD = static_cast<int>(maxVal / sigmaRange) + 1 + 2 * pad;
+    int cell = channels + 1; // channel sums followed by the weight
+    size_t gridSize = static_cast<size_t>(gridW) * gridH * gridD * cell;
+    auto index = [&](int gx, int gy, int gz) { return ((static_cast<size_t>(gz) * gridH + gy) * gridW + gx) * cell; };
+
+    // Bands own disjoint ranges of grid rows, so they splat straight into the shared grid
+    vector<float> grid(gridSize, 0.0f);
+    auto gridRow = [&](int y) { return static_cast<int>(y / sigmaSpatial + 0.5f) + pad; };
+    parallelFor(pad, gridRow(height - 1) + 1, [&](int g0, int g1) {
+        int y = max(0, static_cast<int>((g0 - pad - 0.5f) * sigmaSpatial) - 1);
+        while (y < height && gridRow(y) < g0) y++;
+        for (; y < height && gridRow(y) < g1; y++) {
+            int gy = gridRow(y);
+            for (int x = 0; x < width; x++) {
+                int gx = static_cast<int>(x / sigmaSpatial + 0.5f) + pad;
+                int gz = static_cast<int>(luminanceAt(input, y, x) / sigmaRange + 0.5f) + pad;
+                float* target = &grid[index(gx, gy, gz)];
+                for (int c = 0; c < channels; c++) {
+                    target[c] += input(y, x, c);
+                }
+                target[channels] += 1.0f;
+            }
+        }
+    }, 2);
+
+    // Separable [1 2 1] / 4 blur along x, y and z
+    vector<float> blurred(gridSize, 0.0f);
+    const int steps[3][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+    for (int axis = 0; axis < 3; axis++) {
+        parallelFor(1, gridD - 1, [&](int z0, int z1) {
+            for (int gz = z0; gz < z1; gz++) {
+                for (int gy = 1; gy < gridH - 1; gy++) {
+                    for (int gx = 1; gx < gridW - 1; gx++) {
+                        size_t center = index(gx, gy, gz);
+                        size_t before = index(gx - steps[axis][0], gy - steps[axis][1], gz - steps[axis][2]);
+                        size_t after = index(gx + steps[axis][0], gy + steps[axis][1], gz + steps[axis][2]);
+                        for (int k = 0; k < cell; k++) {
+                            blurred[center + k] = 0.25f * grid[before + k] + 0.5f * grid[center + k] + 0.25f * grid[after + k];
+                        }
+                    }
+                }
+            }
+        }, 1);
+        grid.swap(blurred);
+    }
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        vector<float> values(cell);
+        for (int y = y0; y < y1; y++) {
+            float fy = y / sigmaSpatial + pad;
+            int gy = static_cast<int>(fy);
+            float wy = fy - gy;
+            for (int x = 0; x < width; x++) {
+                float fx = x / sigmaSpatial + pad;
+                float fz = luminanceAt(input, y, x) / sigmaRange + pad;
+                int gx = static_cast<int>(fx), gz = static_cast<int>(fz);
+                float wx = fx - gx, wz = fz - gz;
+
+                fill(values.begin(), values.end(), 0.0f);
+                for (int corner = 0; corner < 8; corner++) {
+                    int ox = corner & 1, oy = (corner >> 1) & 1, oz = (corner >> 2) & 1;
+                    float weight = (ox ? wx : 1 - wx) * (oy ? wy : 1 - wy) * (oz ? wz : 1 - wz);
+                    const float* source = &grid[index(gx + ox, gy + oy, gz + oz)];
+                    for (int k = 0; k < cell; k++) {
+                        values[k] += weight * source[k];
+                    }
+                }
+                for (int c = 0; c < channels; c++) {
+                    output(y, x, c) = values[channels] > 0 ? toSample(values[c] / values[channels], maxVal) : input(y, x, c);
+                }
+            }
+        }
+    });
+
+    return output;
+}
+
+// Bilateral filter: exact for small spatial sigmas, bilateral grid approximation for large ones
+Image applyBilateralFilter(const Image& input, float sigmaSpatial, float sigmaRange) {
+    if (sigmaSpatial <= 3.0f) return applyBilateralExact(input, sigmaSpatial, sigmaRange);
+    return applyBilateralGrid(input, sigmaSpatial, sigmaRange);
+}
+
+/**
+ * Removes noise with non-local means
+ *
+ * Steps:
+ * 1. Copy the image into a flat buffer; split the rows into bands processed in
+ *    parallel, and each band into tiles of at most 64 rows
+ * 2. For each tile and each offset (dx, dy) in the search window:
+ *    - Compute the squared difference (summed over channels) between every pixel
+ *      and the pixel at the offset, over the tile extended by the patch radius
+ *    - Build a summed-area table of those differences, so the distance between
+ *      the two patches around any pixel is 4 lookups (Darbon et al.)
+ *    - weight = exp(-distance / (patch pixels * channels * h^2))
+ *    - Accumulate weight * offset pixel and the weight
+ * 3. The center pixel gets the largest weight seen for its neighbors
+ * 4. new_value = accumulated values / accumulated weights
+ * 5. Return the denoised image (borders are clamped to the nearest pixel)
+ */
+Image applyNonLocalMeans(const Image& input, float h, int searchRadius = 7, int patchRadius = 3) {
+    int height = input.getHeight();
+    int width = input.getWidth();
+    int channels = input.getChannels();
+    int maxVal = input.getMaxVal();
+    Image output(width, height, channels);
+    output.setMaxVal(maxVal);
+    if (width == 0 || height == 0) return output;
+
+    vector<float> pixels(static_cast<size_t>(width) * height * channels);
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < channels; c++) {
+                    pixels[(static_cast<size_t>(y) * width + x) * channels + c] = static_cast<float>(input(y, x, c));
+                }
+            }
+        }
+    });
+    auto at = [&](int y, int x) {
+        y = max(0, min(height - 1, y));
+        x = max(0, min(width - 1, x));
+        return &pixels[(static_cast<size_t>(y) * width + x) * channels];
+    };
+
+    int patchSide = 2 * patchRadius + 1;
+    float scale = 1.0f / (patchSide * patchSide * channels * max(1e-6f, h * h));
+    const int tileRows = 64;
+
+    parallelFor(0, height, [&](int band0, int band1) {
+        for (int t0 = band0; t0 < band1; t0 += tileRows) {
+            int t1 = min(band1, t0 + tileRows);
+            int rows = t1 - t0;
+            int extendedW = width + 2 * patchRadius;
+            int extendedH = rows + 2 * patchRadius;
+            size_t stride = static_cast<size_t>(extendedW) + 1;
+
+            vector<double> integral(stride * (extendedH + 1), 0.0);
+            vector<float> sums(static_cast<size_t>(rows) * width * channels, 0.0f);
+            vector<float> weights(static_cast<size_t>(rows) * width, 0.0f);
+            vector<float> maxWeights(static_cast<size_t>(rows) * width, 0.0f);
+
+            for (int dy = -searchRadius; dy <= searchRadius; dy++) {
+                for (int dx = -searchRadius; dx <= searchRadius; dx++) {
+                    if (dx == 0 && dy == 0) continue;
+
+                    // Summed-area table of squared differences for this offset
+                    for (int ey = 0; ey < extendedH; ey++) {
+                        int y = t0 - patchRadius + ey;
+                        double rowSum = 0;
+                        for (int ex = 0; ex < extendedW; ex++) {
+                            int x = ex - patchRadius;
+                            const float* a = at(y, x);
+                            const float* b = at(y + dy, x + dx);
+                            float difference = 0;
+                            for (int c = 0; c < channels; c++) {
+                                difference += (a[c] - b[c]) * (a[c] - b[c]);
+                            }
+                            rowSum += difference;
+                            integral[(ey + 1) * stride + ex + 1] = integral[ey * stride + ex + 1] + rowSum;
+                        }
+                    }
+
+                    for (int ty = 0; ty < rows; ty++) {
+                        for (int x = 0; x < width; x++) {
+                            // Patch around (t0 + ty, x) is [x, x + patchSide) x [ty, ty + patchSide) in extended coordinates
+                            double distance = integral[(ty + patchSide) * stride + x + patchSide] - integral[ty * stride + x + patchSide]
+                                            - integral[(ty + patchSide) * stride + x] + integral[ty * stride + x];
+                            float weight = exp(-static_cast<float>(distance) * scale);
+                            size_t i = static_cast<size_t>(ty) * width + x;
+                            const float* neighbor = at(t0 + ty + dy, x + dx);
+                            for (int c = 0; c < channels; c++) {
+                                sums[i * channels + c] += weight * neighbor[c];
+                            }
+                            weights[i] += weight;
+                            maxWeights[i] = max(maxWeights[i], weight);
+                        }
+                    }
+                }
+            }
+
+            for (int ty = 0; ty < rows; ty++) {
+                for (int x = 0; x < width; x++) {
+                    size_t i = static_cast<size_t>(ty) * width + x;
+                    float centerWeight = maxWeights[i] > 0 ? maxWeights[i] : 1.0f;
+                    const float* center = at(t0 + ty, x);
+                    for (int c = 0; c < channels; c++) {
+                        float value = (sums[i * channels + c] + centerWeight * center[c]) / (weights[i] + centerWeight);
+                        output(t0 + ty, x, c) = toSample(value, maxVal);
+                    }
+                }
+            }
+        }
+    }, tileRows);
+
+    return output;
+}
+
+/**
+ * Computes the peak signal-to-noise ratio between two images
+ *
+ * Steps:
+ * 1. Sum the squared differences of every channel (row bands in parallel, 64-bit sums)
+ * 2. MSE = sum / (width * height * channels)
+ * 3. Return 10 * log10(maxVal^2 / MSE), or infinity for identical images
+ *    (-1 if the sizes differ)
+ */
+double computePSNR(const Image& a, const Image& b) {
+    if (a.getWidth() != b.getWidth() || a.getHeight() != b.getHeight() || a.getChannels() != b.getChannels()) {
+        cerr << "Error: Image sizes do not match" << endl;
+        return -1.0;
+    }
+
+    int width = a.getWidth();
+    int channels = a.getChannels();
+    long long total = 0;
+    mutex sumMutex;
+    parallelFor(0, a.getHeight(), [&](int y0, int y1) {
+        long long local = 0;
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < channels; c++) {
+                    long long d = a(y, x, c) - b(y, x, c);
+                    local += d * d;
+                }
+            }
+        }
+        lock_guard<mutex> lock(sumMutex);
+        total += local;
+    });
+
+    if (total == 0) return INFINITY;
+    double mse = static_cast<double>(total) / (static_cast<double>(width) * a.getHeight() * channels);
+    double peak = a.getMaxVal();
+    return 10.0 * log10(peak * peak / mse);
+}
+
+// Luminance of every pixel as a flat row-major buffer
+vector<float> luminancePlane(const Image& input) {
+    int height = input.getHeight();
+    int width = input.getWidth();
+    vector<float> plane(static_cast<size_t>(width) * height);
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                plane[static_cast<size_t>(y) * width + x] = static_cast<float>(luminanceAt(input, y, x));
+            }
+        }
+    });
+    return plane;
+}
+
+// Halves a flat plane in both directions by averaging 2x2 blocks
+vector<float> downsamplePlane(const vector<float>& plane, int width, int height) {
+    int w = width / 2, h = height / 2;
+    vector<float> output(static_cast<size_t>(w) * h);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            const float* top = &plane[static_cast<size_t>(2 * y) * width + 2 * x];
+            const float* bottom = top + width;
+            output[static_cast<size_t>(y) * w + x] = 0.25f * (top[0] + top[1] + bottom[0] + bottom[1]);
+        }
+    }
+    return output;
+}
+
+/**
+ * Computes mean SSIM and mean contrast-structure (cs) of two luminance planes
+ *
+ * Steps:
+ * 1. Use an 11x11 Gaussian window (sigma 1.5), applied separably; only windows
+ *    fully inside the image are evaluated
+ * 2. Each row band keeps a ring buffer of horizontally filtered rows of
+ *    x, y, x^2, y^2 and x*y, and filters them vertically per output row
+ * 3. For each window: from the local means, variances and covariance
+ *        cs   = (2 * cov + C2) / (varX + varY + C2)
+ *        ssim = (2 * meanX * meanY + C1) / (meanX^2 + meanY^2 + C1) * cs
+ *    with C1 = (0.01 * L)^2 and C2 = (0.03 * L)^2
+ * 4. Accumulate both in double precision and return their means (false if the
+ *    planes are smaller than the window)
+ */
+bool computeSSIMPlanes(const vector<float>& a, const vector<float>& b, int width, int height, double range,
+                       double& ssim, double& cs) {
+    const int radius = 5;
+    const int side = 2 * radius + 1;
+    if (width < side || height < side) return false;
+
+    vector<float> kernel = gaussianKernel(1.5f, radius);
+    double c1 = (0.01 * range) * (0.01 * range);
+    double c2 = (0.03 * range) * (0.03 * range);
+    int outW = width - 2 * radius;
+    int outH = height - 2 * radius;
+    double ssimSum = 0, csSum = 0;
+    mutex sumMutex;
+
+    parallelFor(0, outH, [&](int o0, int o1) {
+        // Ring of horizontally filtered rows: 5 values per output column
+        vector<double> ring(static_cast<size_t>(side) * outW * 5);
+        auto filterRow = [&](int y) {
+            double* dst = &ring[static_cast<size_t>(y % side) * outW * 5];
+            const float* ra = &a[static_cast<size_t>(y) * width];
+            const float* rb = &b[static_cast<size_t>(y) * width];
+            for (int x = 0; x < outW; x++) {
+                double mx = 0, my = 0, xx = 0, yy = 0, xy = 0;
+                for (int k = 0; k < side; k++) {
+                    double w = kernel[k], va = ra[x + k], vb = rb[x + k];
+                    mx += w * va;
+                    my += w * vb;
+                    xx += w * va * va;
+                    yy += w * vb * vb;
+                    xy += w * va * vb;
+                }
+                double* cell = &dst[static_cast<size_t>(x) * 5];
+                cell[0] = mx; cell[1] = my; cell[2] = xx; cell[3] = yy; cell[4] = xy;
+            }
+        };
+
+        for (int y = o0; y < o0 + side - 1; y++) {
+            filterRow(y);
+        }
+
+        double localSSIM = 0, localCS = 0;
+        for (int oy = o0; oy < o1; oy++) {
+            filterRow(oy + side - 1);
+            for (int x = 0; x < outW; x++) {
+                double m[5] = { 0, 0, 0, 0, 0 };
+                for (int k = 0; k < side; k++) {
+                    const double* cell = &ring[(static_cast<size_t>((oy + k) % side) * outW + x) * 5];
+                    for (int q = 0; q < 5; q++) {
+                        m[q] += kernel[k] * cell[q];
+                    }
+                }
+                double varX = m[2] - m[0] * m[0];
+                double varY = m[3] - m[1] * m[1];
+                double cov = m[4] - m[0] * m[1];
+                double contrast = (2.0 * cov + c2) / (varX + varY + c2);
+                localCS += contrast;
+                localSSIM += (2.0 * m[0] * m[1] + c1) / (m[0] * m[0] + m[1] * m[1] + c1) * contrast;
+            }
+        }
+
+        lock_guard<mutex> lock(sumMutex);
+        ssimSum += localSSIM;
+        csSum += localCS;
+    });
+
+    double windows = static_cast<double>(outW) * outH;
+    ssim = ssimSum / windows;
+    cs = csSum / windows;
+    return true;
+}
+
+/**
+ * Computes the structural similarity (SSIM) of two images
+ *
+ * Steps:
+ * 1. Convert both images to luminance
+ * 2. Return the mean SSIM over all 11x11 Gaussian windows
+ *    (-1 if the sizes differ or the images are smaller than the window)
+ */
+double computeSSIM(const Image& a, const Image& b) {
+    if (a.getWidth() != b.getWidth() || a.getHeight() != b.getHeight()) {
+        cerr << "Error: Image sizes do not match" << endl;
+        return -1.0;
+    }
+
+    double ssim, cs;
+    if (!computeSSIMPlanes(luminancePlane(a), luminancePlane(b), a.getWidth(), a.getHeight(), a.getMaxVal(), ssim, cs)) {
+        return -1.0;
+    }
+    return ssim;
+}
+
+/**
+ * Computes multi-scale SSIM (MS-SSIM) of two images
+ *
+ * Steps:
+ * 1. Convert both images to luminance
+ * 2. For up to 5 scales (fewer if the image becomes smaller than the window):
+ *    - Compute mean cs (and mean SSIM at the last scale)
+ *    - Halve both planes by 2x2 averaging
+ * 3. Return the product of cs^weight over the scales, using SSIM at the last one,
+ *    with the standard weights renormalized to the scales used
+ */
+double computeMSSSIM(const Image& a, const Image& b) {
+    if (a.getWidth() != b.getWidth() || a.getHeight() != b.getHeight()) {
+        cerr << "Error: Image sizes do not match" << endl;
+        return -1.0;
+    }
+
+    const double weights[5] = { 0.0448, 0.2856, 0.3001, 0.2363, 0.1333 };
+    vector<float> planeA = luminancePlane(a), planeB = luminancePlane(b);
+    int width = a.getWidth(), height = a.getHeight();
+
+    vector<double> csValues;
+    double lastSSIM = 0;
+    for (int scale = 0; scale < 5; scale++) {
+        double ssim, cs;
+        if (!computeSSIMPlanes(planeA, planeB, width, height, a.getMaxVal(), ssim, cs)) break;
+        csValues.push_back(cs);
+        lastSSIM = ssim;
+        if (scale < 4) {
+            planeA = downsamplePlane(planeA, width, height);
+            planeB = downsamplePlane(planeB, width, height);
+            width /= 2;
+            height /= 2;
+        }
+    }
+    if (csValues.empty()) return -1.0;
+
+    double weightTotal = 0;
+    for (size_t i = 0; i < csValues.size(); i++) weightTotal += weights[i];
+
+    double result = 1.0;
+    for (size_t i = 0; i < csValues.size(); i++) {
+        double value = i + 1 == csValues.size() ? lastSSIM : csValues[i];
+        result *= pow(max(0.0, value), weights[i] / weightTotal);
+    }
+    return result;
+}
+
+// Result of comparing two images
+struct ImageDiff {
+    bool sizeMismatch = false;
+    bool identical = true;
+    int maxError = 0;                 // largest absolute channel difference
+    double meanError = 0;             // mean absolute channel difference
+    long long changedPixels = 0;      // pixels with any channel differing by more than the tolerance
+    vector<Region> changedRegions;    // bounding boxes of connected changed areas
+};
+
+/**
+ * Checks whether two images are exactly equal
+ *
+ * Steps:
+ * 1. Compare dimensions, channels and maxVal
+ * 2. Compare rows in parallel bands; every band stops as soon as any band finds a difference
+ * 3. Return true if no difference was found
+ */
+bool imagesEqual(const Image& a, const Image& b) {
+    if (a.getWidth() != b.getWidth() || a.getHeight() != b.getHeight() ||
+        a.getChannels() != b.getChannels() || a.getMaxVal() != b.getMaxVal()) {
+        return false;
+    }
+
+    int width = a.getWidth();
+    int channels = a.getChannels();
+    atomic<bool> different(false);
+    parallelFor(0, a.getHeight(), [&](int y0, int y1) {
+        for (int y = y0; y < y1 && !different.load(memory_order_relaxed); y++) {
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < channels; c++) {
+                    if (a(y, x, c) != b(y, x, c)) {
+                        different.store(true, memory_order_relaxed);
+                        return;
+                    }
+                }
+            }
+        }
+    });
+
+    return !different.load();
+}
+
+/**
+ * Compares two images
+ *
+ * Steps:
+ * 1. For each pixel (rows processed in parallel bands):
+ *    - Accumulate the absolute channel differences and track the largest one
+ *    - Mark the pixel as changed in a bit mask if any difference exceeds the tolerance
+ * 2. Label the connected changed areas of the mask and keep their bounding boxes
+ * 3. Return the error statistics and changed regions
+ */
+ImageDiff compareImages(const Image& a, const Image& b, int tolerance = 0) {
+    ImageDiff diff;
+    if (a.getWidth() != b.getWidth() || a.getHeight() != b.getHeight() || a.getChannels() != b.getChannels()) {
+        diff.sizeMismatch = true;
+        diff.identical = false;
+        return diff;
+    }
+
+    int width = a.getWidth();
+    int height = a.getHeight();
+    int channels = a.getChannels();
+    BitMask changed(width, height);
+    long long totalError = 0;
+    mutex sumMutex;
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        long long localError = 0, localChanged = 0;
+        int localMax = 0;
+        for (int y = y0; y < y1; y++) {
+            uint64_t* words = changed.row(y);
+            for (int x = 0; x < width; x++) {
+                int pixelMax = 0;
+                for (int c = 0; c < channels; c++) {
+                    int d = abs(a(y, x, c) - b(y, x, c));
+                    localError += d;
+                    pixelMax = max(pixelMax, d);
+                }
+                localMax = max(localMax, pixelMax);
+                if (pixelMax > tolerance) {
+                    words[x / 64] |= uint64_t(1) << (x % 64);
+                    localChanged++;
+                }
+            }
+        }
+        lock_guard<mutex> lock(sumMutex);
+        totalError += localError;
+        diff.changedPixels += localChanged;
+        diff.maxError = max(diff.maxError, localMax);
+    });
+
+    long long samples = static_cast<long long>(width) * height * channels;
+    diff.meanError = samples > 0 ? static_cast<double>(totalError) / samples : 0.0;
+    diff.identical = diff.maxError == 0;
+
+    if (diff.changedPixels > 0) {
+        LabelResult components = labelComponents(changed, 8);
+        for (const ComponentStats& component : components.components) {
+            Region box;
+            box.x = component.minX;
+            box.y = component.minY;
+            box.width = component.maxX - component.minX + 1;
+            box.height = component.maxY - component.minY + 1;
+            diff.changedRegions.push_back(box);
+        }
+    }
+
+    return diff;
+}
+
+/**
+ * Builds a heat map of the differences between two images
+ *
+ * Steps:
+ * 1. For each pixel, take the largest absolute channel difference scaled to [0, 1]
+ * 2. Map it to a black -> red -> yellow -> white color ramp
+ * 3. Return the 3-channel heat map (empty if the sizes differ)
+ */
+Image diffHeatMap(const Image& a, const Image& b) {
+    if (a.getWidth() != b.getWidth() || a.getHeight() != b.getHeight() || a.getChannels() != b.getChannels()) {
+        cerr << "Error: Image sizes do not match" << endl;
+        return Image();
+    }
+
+    int width = a.getWidth();
+    int height = a.getHeight();
+    int channels = a.getChannels();
+    float maxVal = static_cast<float>(a.getMaxVal());
+    Image output(width, height, 3);
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                int d = 0;
+                for (int c = 0; c < channels; c++) {
+                    d = max(d, abs(a(y, x, c) - b(y, x, c)));
+                }
+                float t = min(1.0f, d / maxVal) * 3.0f;
+                output(y, x, 0) = toSample(min(1.0f, t) * 255.0f, 255);
+                output(y, x, 1) = toSample(max(0.0f, min(1.0f, t - 1.0f)) * 255.0f, 255);
+                output(y, x, 2) = toSample(max(0.0f, min(1.0f, t - 2.0f)) * 255.0f, 255);
+            }
+        }
+    });
+
+    return output;
+}
+
+// Reads a PPM file (P3 or P6) one row at a time, without loading the whole image
+class PPMRowReader {
+private:
+    ifstream file;
+    bool binary;
+    int width, height, maxVal;
+    vector<unsigned char> buffer;
+
+public:
+    PPMRowReader() {
+        binary = false;
+        width = 0;
+        height = 0;
+        maxVal = 255;
+    }
+
+    bool open(const string& filename) {
+        file.open(filename, ios::binary);
+        if (!file.is_open()) {
+            cerr << "Error: Could not open file " << filename << endl;
+            return false;
+        }
+
+        string format;
+        file >> format;
+        if (format != "P3" && format != "P6") {
+            cerr << "Error: Only P3 and P6 PPM formats are supported" << endl;
+            return false;
+        }
+        binary = format == "P6";
+        file >> width >> height >> maxVal;
+        file.get(); // single whitespace before the raster
+        return static_cast<bool>(file);
+    }
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    int getMaxVal() const { return maxVal; }
+
+    // Reads the next row as interleaved R, G, B samples
+    bool readRow(vector<int>& row) {
+        row.resize(static_cast<size_t>(width) * 3);
+        if (!binary) {
+            for (int& v : row) file >> v;
+            return static_cast<bool>(file);
+        }
+
+        int bytesPerSample = maxVal > 255 ? 2 : 1;
+        buffer.resize(row.size() * bytesPerSample);
+        file.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
+        if (!file) return false;
+        for (size_t i = 0; i < row.size(); i++) {
+            row[i] = bytesPerSample == 2 ? (buffer[2 * i] << 8 | buffer[2 * i + 1]) : buffer[i];
+        }
+        return true;
+    }
+
+    // Skips the next row without converting it
+    bool skipRow() {
+        if (!binary) {
+            int v;
+            for (int i = 0; i < width * 3; i++) file >> v;
+            return static_cast<bool>(file);
+        }
+        file.seekg(static_cast<streamoff>(width) * 3 * (maxVal > 255 ? 2 : 1), ios::cur);
+        return static_cast<bool>(file);
+    }
+};
+
+/**
+ * Compares two PPM files row by row, for inputs too large to load
+ *
+ * Steps:
+ * 1. Open both files and compare their headers
+ * 2. Read one row of each at a time and accumulate the error statistics
+ * 3. Track a single bounding box around all changed pixels
+ * 4. If stopAtFirstDifference is set, stop after the row holding the first changed pixel
+ * 5. Return the statistics (changedRegions holds at most one box; meanError covers the
+ *    rows read)
+ */
+ImageDiff compareFilesStreaming(const string& fileA, const string& fileB, int tolerance = 0,
+                                bool stopAtFirstDifference = false) {
+    ImageDiff diff;
+    PPMRowReader readerA, readerB;
+    if (!readerA.open(fileA) || !readerB.open(fileB) ||
+        readerA.getWidth() != readerB.getWidth() || readerA.getHeight() != readerB.getHeight()) {
+        diff.sizeMismatch = true;
+        diff.identical = false;
+        return diff;
+    }
+
+    int width = readerA.getWidth();
+    int height = readerA.getHeight();
+    vector<int> rowA, rowB;
+    long long totalError = 0;
+    int minX = width, minY = height, maxX = -1, maxY = -1;
+    int rowsRead = 0;
+
+    for (int y = 0; y < height; y++) {
+        if (!readerA.readRow(rowA) || !readerB.readRow(rowB)) {
+            cerr << "Error: Unexpected end of file while comparing" << endl;
+            diff.identical = false;
+            return diff;
+        }
+        for (int x = 0; x < width; x++) {
+            int pixelMax = 0;
+            for (int c = 0; c < 3; c++) {
+                int d = abs(rowA[x * 3 + c] - rowB[x * 3 + c]);
+                totalError += d;
+                pixelMax = max(pixelMax, d);
+            }
+            diff.maxError = max(diff.maxError, pixelMax);
+            if (pixelMax > tolerance) {
+                diff.changedPixels++;
+                minX = min(minX, x);
+                maxX = max(maxX, x);
+                minY = min(minY, y);
+                maxY = max(maxY, y);
+            }
+        }
+        rowsRead++;
+        if (stopAtFirstDifference && diff.changedPixels > 0) break;
+    }
+
+    // Mean over the rows actually compared (fewer when stopping early)
+    long long samples = static_cast<long long>(width) * rowsRead * 3;
+    diff.meanError = samples > 0 ? static_cast<double>(totalError) / samples : 0.0;
+    diff.identical = diff.maxError == 0;
+    if (diff.changedPixels > 0) {
+        Region box;
+        box.x = minX;
+        box.y = minY;
+        box.width = maxX - minX + 1;
+        box.height = maxY - minY + 1;
+        diff.changedRegions.push_back(box);
+    }
+
+    return diff;
+}
+
+/**
+ * Downscales an image's luminance by area averaging
+ *
+ * Steps:
+ * 1. Split the image into a targetWidth x targetHeight grid of (possibly uneven) cells,
+ *    each covering at least one pixel (the nearest one when the grid is larger than the image)
+ * 2. For each cell (target rows processed in parallel): average the luminance of its pixels
+ * 3. Return the averages as a flat row-major buffer
+ */
+vector<float> downscaleLuminance(const Image& input, int targetWidth, int targetHeight) {
+    int height = input.getHeight();
+    int width = input.getWidth();
+    vector<float> output(static_cast<size_t>(targetWidth) * targetHeight, 0.0f);
+    if (width == 0 || height == 0) return output;
+
+    // Source columns x with x * targetWidth / width == tx; a column that gets none (grid
+    // wider than the image) uses the pixel it lies in, so no cell is left empty
+    vector<int> columnStart(targetWidth), columnEnd(targetWidth);
+    for (int tx = 0; tx < targetWidth; tx++) {
+        long long left = static_cast<long long>(tx) * width;
+        columnStart[tx] = static_cast<int>((left + targetWidth - 1) / targetWidth);
+        columnEnd[tx] = static_cast<int>((left + width + targetWidth - 1) / targetWidth);
+        if (columnStart[tx] >= columnEnd[tx]) {
+            columnStart[tx] = static_cast<int>(left / targetWidth);
+            columnEnd[tx] = columnStart[tx] + 1;
+        }
+    }
+
+    parallelFor(0, targetHeight, [&](int ty0, int ty1) {
+        for (int ty = ty0; ty < ty1; ty++) {
+            int y0 = static_cast<int>(static_cast<long long>(ty) * height / targetHeight);
+            int y1 = max(y0 + 1, static_cast<int>(static_cast<long long>(ty + 1) * height / targetHeight));
+            for (int tx = 0; tx < targetWidth; tx++) {
+                double sum = 0.0;
+                for (int y = y0; y < y1; y++) {
+                    for (int x = columnStart[tx]; x < columnEnd[tx]; x++) sum += luminanceAt(input, y, x);
+                }
+                int count = (y1 - y0) * (columnEnd[tx] - columnStart[tx]);
+                output[static_cast<size_t>(ty) * targetWidth + tx] = static_cast<float>(sum / count);
+            }
+        }
+    }, 1);
+
+    return output;
+}
+
+// Number of differing bits between two hashes
+int hammingDistance(uint64_t a, uint64_t b) {
+    return popcount64(a ^ b);
+}
+
+/**
+ * Computes the average hash (aHash)
+ *
+ * Steps:
+ * 1. Downscale the luminance to 8x8
+ * 2. Set bit i if cell i is brighter than the mean of all cells
+ * 3. Return the 64-bit hash
+ */
+uint64_t computeAverageHash(const Image& input) {
+    vector<float> cells = downscaleLuminance(input, 8, 8);
+    float mean = 0;
+    for (float v : cells) mean += v;
+    mean /= 64.0f;
+
+    uint64_t hash = 0;
+    for (int i = 0; i < 64; i++) {
+        if (cells[i] > mean) hash |= uint64_t(1) << i;
+    }
+    return hash;
+}
+
+/**
+ * Computes the difference hash (dHash)
+ *
+ * Steps:
+ * 1. Downscale the luminance to 9x8
+ * 2. Set bit (y * 8 + x) if cell (y, x) is brighter than its right neighbor
+ * 3. Return the 64-bit hash
+ */
+uint64_t computeDifferenceHash(const Image& input) {
+    vector<float> cells = downscaleLuminance(input, 9, 8);
+    uint64_t hash = 0;
+    for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 8; x++) {
+            if (cells[y * 9 + x] > cells[y * 9 + x + 1]) hash |= uint64_t(1) << (y * 8 + x);
+        }
+    }
+    return hash;
+}
+
+/**
+ * Computes the perceptual hash (pHash)
+ *
+ * Steps:
+ * 1. Downscale the luminance to 32x32
+ * 2. Take the 2D DCT-II and keep the 8x8 lowest frequencies
+ *    (only the 8 needed coefficients per row and column are computed)
+ * 3. Set bit i if coefficient i is above the median of the 63 AC coefficients
+ * 4. Return the 64-bit hash
+ */
+uint64_t computePerceptualHash(const Image& input) {
+    const int size = 32;
+    const double pi = 3.14159265358979323846;
+    vector<float> cells = downscaleLuminance(input, size, size);
+
+    double basis[8][size];
+    for (int u = 0; u < 8; u++) {
+        for (int x = 0; x < size; x++) {
+            basis[u][x] = cos((2 * x + 1) * u * pi / (2 * size));
+        }
+    }
+
+    // Rows first (32 x 8), then columns (8 x 8)
+    double rows[size][8];
+    for (int y = 0; y < size; y++) {
+        for (int u = 0; u < 8; u++) {
+            double sum = 0;
+            for (int x = 0; x < size; x++) sum += cells[y * size + x] * basis[u][x];
+            rows[y][u] = sum;
+        }
+    }
+    double coefficients[64];
+    for (int v = 0; v < 8; v++) {
+        for (int u = 0; u < 8; u++) {
+            double sum = 0;
+            for (int y = 0; y < size; y++) sum += rows[y][u] * basis[v][y];
+            coefficients[v * 8 + u] = sum;
+        }
+    }
+
+    vector<double> ac(coefficients + 1, coefficients + 64);
+    nth_element(ac.begin(), ac.begin() + ac.size() / 2, ac.end());
+    double median = ac[ac.size() / 2];
+
+    uint64_t hash = 0;
+    for (int i = 0; i < 64; i++) {
+        if (coefficients[i] > median) hash |= uint64_t(1) << i;
+    }
+    return hash;
+}
+
+// BK-tree over 64-bit hashes for Hamming-distance range queries
+// Each child edge is labelled with its distance to the parent, so a query with radius r
+// only descends into children whose label lies within r of the query's distance to the node
+class HashIndex {
+private:
+    struct Node {
+        uint64_t hash;
+        vector<int> ids;                     // all ids sharing this exact hash
+        vector<pair<int, int>> children;     // (distance to this node, child node index)
+    };
+    vector<Node> nodes;
+    int idCount = 0;
+
+public:
+    // Adds a hash with a caller-chosen id
+    void add(uint64_t hash, int id) {
+        idCount++;
+        if (nodes.empty()) {
+            nodes.push_back(Node{ hash, { id }, {} });
+            return;
+        }
+
+        int current = 0;
+        while (true) {
+            int distance = hammingDistance(hash, nodes[current].hash);
+            if (distance == 0) {
+                nodes[current].ids.push_back(id);
+                return;
+            }
+            int next = -1;
+            for (const pair<int, int>& child : nodes[current].children) {
+                if (child.first == distance) {
+                    next = child.second;
+                    break;
+                }
+            }
+            if (next < 0) {
+                nodes.push_back(Node{ hash, { id }, {} });
+                nodes[current].children.emplace_back(distance, static_cast<int>(nodes.size()) - 1);
+                return;
+            }
+            current = next;
+        }
+    }
+
+    // Returns (id, distance) for every stored hash within maxDistance of the query
+    vector<pair<int, int>> query(uint64_t hash, int maxDistance) const {
+        vector<pair<int, int>> results;
+        if (nodes.empty()) return results;
+
+        vector<int> pending(1, 0);
+        while (!pending.empty()) {
+            const Node& node = nodes[pending.back()];
+            pending.pop_back();
+            int distance = hammingDistance(hash, node.hash);
+            if (distance <= maxDistance) {
+                for (int id : node.ids) results.emplace_back(id, distance);
+            }
+            for (const pair<int, int>& child : node.children) {
+                if (abs(child.first - distance) <= maxDistance) pending.push_back(child.second);
+            }
+        }
+        return results;
+    }
+
+    // Number of ids added (duplicate hashes counted once per id)
+    int size() const { return idCount; }
+
+    // Number of distinct hashes stored
+    int distinctHashes() const { return static_cast<int>(nodes.size()); }
+};
+
+// Interleaved 8-bit samples of an image (gray is expanded to RGB), rows in parallel
+vector<unsigned char> packPixels8(const Image& input, int outputChannels) {
+    int height = input.getHeight();
+    int width = input.getWidth();
+    int channels = input.getChannels();
+    bool gray = channels < 3;
+    bool hasAlpha = channels == 2 || channels == 4;
+    vector<unsigned char> pixels(static_cast<size_t>(width) * height * outputChannels);
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            unsigned char* dst = &pixels[static_cast<size_t>(y) * width * outputChannels];
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < 3 && c < outputChannels; c++) {
+                    dst[c] = static_cast<unsigned char>(max(0, min(255, input(y, x, gray ? 0 : c))));
+                }
+                if (outputChannels == 4) {
+                    dst[3] = static_cast<unsigned char>(hasAlpha ? max(0, min(255, input(y, x, channels - 1))) : 255);
+                }
+                dst += outputChannels;
+            }
+        }
+    });
+
+    return pixels;
+}
+
+// Fills an image from interleaved 8-bit samples, rows in parallel
+void unpackPixels8(const vector<unsigned char>& pixels, int width, int height, int channels, Image& output) {
+    reshapeImage(output, width, height, channels);
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            const unsigned char* src = &pixels[static_cast<size_t>(y) * width * channels];
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < channels; c++) {
+                    output(y, x, c) = src[c];
+                }
+                src += channels;
+            }
+        }
+    });
+}
+
+/**
+ * Encodes a run of pixels with the QOI operations
+ *
+ * Steps:
+ * 1. For each pixel, emit the shortest operation that reproduces it:
+ *    - RUN (repeat the previous pixel, up to 62 times)
+ *    - INDEX (pixel seen earlier, looked up by hash in a 64-entry table)
+ *    - DIFF (small per-channel difference) or LUMA (green difference plus red/blue offsets)
+ *    - RGB or RGBA (full pixel)
+ * 2. The first pixel is always written in full and the table starts empty, so the
+ *    segment decodes correctly whatever a standard decoder saw before it
+ *    (segments encoded separately can be concatenated into one valid stream)
+ */
+void encodeQOISegment(const unsigned char* pixels, size_t count, int channels, vector<unsigned char>& out) {
+    unsigned char index[64][4] = {};
+    bool used[64] = {};
+    unsigned char prev[4] = { 0, 0, 0, 255 };
+    int run = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const unsigned char* p = pixels + i * channels;
+        unsigned char px[4] = { p[0], p[1], p[2], static_cast<unsigned char>(channels == 4 ? p[3] : 255) };
+        bool same = i > 0 && px[0] == prev[0] && px[1] == prev[1] && px[2] == prev[2] && px[3] == prev[3];
+
+        if (same) {
+            run++;
+            if (run == 62) {
+                out.push_back(static_cast<unsigned char>(0xC0 | (run - 1)));
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            out.push_back(static_cast<unsigned char>(0xC0 | (run - 1)));
+            run = 0;
+        }
+
+        int hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+        if (i > 0 && used[hash] && memcmp(index[hash], px, 4) == 0) {
+            out.push_back(static_cast<unsigned char>(hash));
+        }
+        else {
+            memcpy(index[hash], px, 4);
+            used[hash] = true;
+
+            if (i > 0 && px[3] == prev[3]) {
+                signed char dr = static_cast<signed char>(px[0] - prev[0]);
+                signed char dg = static_cast<signed char>(px[1] - prev[1]);
+                signed char db = static_cast<signed char>(px[2] - prev[2]);
+                signed char drg = static_cast<signed char>(dr - dg);
+                signed char dbg = static_cast<signed char>(db - dg);
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                    out.push_back(static_cast<unsigned char>(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+                }
+                else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7) {
+                    out.push_back(static_cast<unsigned char>(0x80 | (dg + 32)));
+                    out.push_back(static_cast<unsigned char>((drg + 8) << 4 | (dbg + 8)));
+                }
+                else {
+                    out.push_back(0xFE);
+                    out.insert(out.end(), px, px + 3);
+                }
+            }
+            else {
+                // First pixel of a segment or an alpha change; for RGBA, writing the alpha
+                // also resets whatever alpha the decoder carried in from before the segment
+                out.push_back(channels == 4 ? 0xFF : 0xFE);
+                out.insert(out.end(), px, px + (channels == 4 ? 4 : 3));
+            }
+        }
+        memcpy(prev, px, 4);
+    }
+
+    if (run > 0) {
+        out.push_back(static_cast<unsigned char>(0xC0 | (run - 1)));
+    }
+}
+
+// Appends a 32-bit big-endian value
+void putBigEndian32(vector<unsigned char>& out, uint32_t value) {
+    out.push_back(static_cast<unsigned char>(value >> 24));
+    out.push_back(static_cast<unsigned char>(value >> 16));
+    out.push_back(static_cast<unsigned char>(value >> 8));
+    out.push_back(static_cast<unsigned char>(value));
+}
+
+uint32_t getBigEndian32(const unsigned char* p) {
+    return static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16 | static_cast<uint32_t>(p[2]) << 8 | p[3];
+}
+
+/**
+ * Encodes an 8-bit image in the QOI format
+ *
+ * Steps:
+ * 1. Write the 14-byte header ("qoif", width, height, channels, colorspace)
+ * 2. Pack the pixels as RGB (or RGBA if the image has alpha)
+ * 3. If parallel, encode row bands as independent segments on separate threads;
+ *    otherwise encode the whole image as one segment
+ * 4. Concatenate the segments and append the end marker
+ * 5. Return the encoded bytes (empty if the image is not 8-bit)
+ */
+vector<unsigned char> encodeQOI(const Image& input, bool parallel = true) {
+    vector<unsigned char> out;
+    if (input.getMaxVal() > 255) {
+        cerr << "Error: QOI only supports 8-bit images" << endl;
+        return out;
+    }
+
+    int width = input.getWidth();
+    int height = input.getHeight();
+    int channels = input.getChannels() == 2 || input.getChannels() == 4 ? 4 : 3;
+    vector<unsigned char> pixels = packPixels8(input, channels);
+    size_t rowBytes = static_cast<size_t>(width) * channels;
+
+    out.insert(out.end(), { 'q', 'o', 'i', 'f' });
+    putBigEndian32(out, static_cast<uint32_t>(width));
+    putBigEndian32(out, static_cast<uint32_t>(height));
+    out.push_back(static_cast<unsigned char>(channels));
+    out.push_back(0); // sRGB with linear alpha
+
+    if (!parallel) {
+        encodeQOISegment(pixels.data(), static_cast<size_t>(width) * height, channels, out);
+    }
+    else {
+        map<int, vector<unsigned char>> segments;
+        mutex segmentMutex;
+        parallelFor(0, height, [&](int y0, int y1) {
+            vector<unsigned char> segment;
+            segment.reserve((y1 - y0) * rowBytes / 2);
+            encodeQOISegment(&pixels[y0 * rowBytes], static_cast<size_t>(y1 - y0) * width, channels, segment);
+            lock_guard<mutex> lock(segmentMutex);
+            segments[y0].swap(segment);
+        }, 64);
+        for (auto& entry : segments) {
+            out.insert(out.end(), entry.second.begin(), entry.second.end());
+        }
+    }
+
+    out.insert(out.end(), { 0, 0, 0, 0, 0, 0, 0, 1 });
+    return out;
+}
+
+/**
+ * Decodes a QOI stream into an image
+ *
+ * Steps:
+ * 1. Check the header and read width, height and channels; reject pixel counts above
+ *    400M or beyond what the data could encode before allocating anything
+ * 2. Replay the operations, keeping the previous pixel and the 64-entry table
+ * 3. Return false if the data is truncated or the header is invalid
+ */
+bool decodeQOI(const vector<unsigned char>& data, Image& output) {
+    if (data.size() < 22 || memcmp(data.data(), "qoif", 4) != 0) {
+        cerr << "Error: Invalid QOI data" << endl;
+        return false;
+    }
+
+    int width = static_cast<int>(getBigEndian32(&data[4]));
+    int height = static_cast<int>(getBigEndian32(&data[8]));
+    int channels = data[12];
+    if (width <= 0 || height <= 0 || (channels != 3 && channels != 4)) {
+        cerr << "Error: Invalid QOI header" << endl;
+        return false;
+    }
+
+    // Each op byte yields at most 62 pixels (a full run), so a header asking for more than
+    // that cannot be decoded from this data; refuse it before allocating, like the 400M
+    // pixel limit of the reference decoder
+    size_t count = static_cast<size_t>(width) * height;
+    if (count > 400000000 || count > (data.size() - 22) * 62) {
+        cerr << "Error: QOI image size is implausible for its data" << endl;
+        return false;
+    }
+    vector<unsigned char> pixels(count * channels);
+    unsigned char index[64][4] = {};
+    unsigned char px[4] = { 0, 0, 0, 255 };
+    size_t pos = 14, end = data.size() - 8;
+    int run = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (run > 0) {
+            run--;
+        }
+        else if (pos < end) {
+            unsigned char op = data[pos++];
+            if (op == 0xFE) {
+                px[0] = data[pos]; px[1] = data[pos + 1]; px[2] = data[pos + 2];
+                pos += 3;
+            }
+            else if (op == 0xFF) {
+                memcpy(px, &data[pos], 4);
+                pos += 4;
+            }
+            else if ((op & 0xC0) == 0x00) {
+                memcpy(px, index[op], 4);
+            }
+            else if ((op & 0xC0) == 0x40) {
+                px[0] = static_cast<unsigned char>(px[0] + ((op >> 4) & 3) - 2);
+                px[1] = static_cast<unsigned char>(px[1] + ((op >> 2) & 3) - 2);
+                px[2] = static_cast<unsigned char>(px[2] + (op & 3) - 2);
+            }
+            else if ((op & 0xC0) == 0x80) {
+                unsigned char second = data[pos++];
+                int dg = (op & 0x3F) - 32;
+                px[0] = static_cast<unsigned char>(px[0] + dg - 8 + ((second >> 4) & 0x0F));
+                px[1] = static_cast<unsigned char>(px[1] + dg);
+                px[2] = static_cast<unsigned char>(px[2] + dg - 8 + (second & 0x0F));
+            }
+            else {
+                run = op & 0x3F;
+            }
+            memcpy(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64], px, 4);
+        }
+        else {
+            cerr << "Error: Truncated QOI data" << endl;
+            return false;
+        }
+        memcpy(&pixels[i * channels], px, channels);
+    }
+
+    unpackPixels8(pixels, width, height, channels, output);
+    return true;
+}
+
+// Saves an 8-bit image as a QOI file
+bool saveQOI(const Image& img, const string& filename, bool parallel = true) {
+    vector<unsigned char> data = encodeQOI(img, parallel);
+    if (data.empty()) return false;
+
+    ofstream file(filename, ios::binary);
+    if (!file.is_open()) {
+        cerr << "Error: Could not create file " << filename << endl;
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(data.data()), data.size());
+    file.close();
+    return true;
+}
+
+// Loads a QOI file
+bool loadQOI(Image& img, const string& filename) {
+    ifstream file(filename, ios::binary);
+    if (!file.is_open()) {
+        cerr << "Error: Could not open file " << filename << endl;
+        return false;
+    }
+    vector<unsigned char> data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    return decodeQOI(data, img);
+}
+
+// Copies a rectangular region of an image (clipped to the image bounds)
+Image cropImage(const Image& input, Region roi) {
+    roi = clipRegion(input, roi);
+    int channels = input.getChannels();
+    Image output(roi.width, roi.height, channels);
+    output.setMaxVal(input.getMaxVal());
+
+    parallelFor(0, roi.height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < roi.width; x++) {
+                for (int c = 0; c < channels; c++) {
+                    output(y, x, c) = input(roi.y + y, roi.x + x, c);
+                }
+            }
+        }
+    });
+
+    return output;
+}
+
+// Header of a tiled image file: "TQOI", sizes, then the byte offset of every tile
+// (row-major) plus the end offset; each tile is a standalone QOI stream
+struct TiledHeader {
+    int width = 0;
+    int height = 0;
+    int tileWidth = 0;
+    int tileHeight = 0;
+    int tilesX = 0;
+    int tilesY = 0;
+    vector<uint64_t> offsets;
+};
+
+bool readTiledHeader(ifstream& file, TiledHeader& header) {
+    unsigned char fixed[20];
+    file.read(reinterpret_cast<char*>(fixed), sizeof(fixed));
+    if (!file || memcmp(fixed, "TQOI", 4) != 0) {
+        cerr << "Error: Not a tiled image file" << endl;
+        return false;
+    }
+
+    header.width = static_cast<int>(getBigEndian32(&fixed[4]));
+    header.height = static_cast<int>(getBigEndian32(&fixed[8]));
+    header.tileWidth = static_cast<int>(getBigEndian32(&fixed[12]));
+    header.tileHeight = static_cast<int>(getBigEndian32(&fixed[16]));
+    if (header.width <= 0 || header.height <= 0 || header.tileWidth <= 0 || header.tileHeight <= 0) {
+        cerr << "Error: Invalid tiled image header" << endl;
+        return false;
+    }
+    header.tilesX = (header.width + header.tileWidth - 1) / header.tileWidth;
+    header.tilesY = (header.height + header.tileHeight - 1) / header.tileHeight;
+
+    file.seekg(0, ios::end);
+    uint64_t fileSize = static_cast<uint64_t>(file.tellg());
+    file.seekg(sizeof(fixed));
+
+    uint64_t count = static_cast<uint64_t>(header.tilesX) * header.tilesY + 1;
+    if (count > (fileSize - sizeof(fixed)) / 8) {
+        cerr << "Error: Truncated tile index" << endl;
+        return false;
+    }
+    vector<unsigned char> table(static_cast<size_t>(count) * 8);
+    file.read(reinterpret_cast<char*>(table.data()), table.size());
+    if (!file) {
+        cerr << "Error: Truncated tile index" << endl;
+        return false;
+    }
+    header.offsets.resize(static_cast<size_t>(count));
+    for (size_t i = 0; i < count; i++) {
+        header.offsets[i] = static_cast<uint64_t>(getBigEndian32(&table[i * 8])) << 32 | getBigEndian32(&table[i * 8 + 4]);
+    }
+
+    // Tiles must follow the index in order and end inside the file
+    if (header.offsets[0] < sizeof(fixed) + table.size() || header.offsets.back() > fileSize) {
+        cerr << "Error: Invalid tile index" << endl;
+        return false;
+    }
+    for (size_t i = 0; i + 1 < count; i++) {
+        if (header.offsets[i] > header.offsets[i + 1]) {
+            cerr << "Error: Invalid tile index" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Saves an 8-bit image as independently compressed tiles
+ *
+ * Steps:
+ * 1. Split the image into tileSize x tileSize tiles (edge tiles may be smaller)
+ * 2. Encode every tile as its own QOI stream, tiles spread across threads
+ * 3. Write the header, the offset index, then the tile streams in row-major order
+ */
+bool saveTiled(const Image& img, const string& filename, int tileSize = 256) {
+    if (img.getMaxVal() > 255) {
+        cerr << "Error: Tiled images only support 8-bit data" << endl;
+        return false;
+    }
+
+    int width = img.getWidth();
+    int height = img.getHeight();
+    tileSize = max(1, tileSize);
+    int tilesX = (width + tileSize - 1) / tileSize;
+    int tilesY = (height + tileSize - 1) / tileSize;
+    int count = tilesX * tilesY;
+
+    vector<vector<unsigned char>> tiles(count);
+    parallelFor(0, count, [&](int t0, int t1) {
+        for (int t = t0; t < t1; t++) {
+            Region tile;
+            tile.x = (t % tilesX) * tileSize;
+            tile.y = (t / tilesX) * tileSize;
+            tile.width = tileSize;
+            tile.height = tileSize;
+            tiles[t] = encodeQOI(cropImage(img, tile), false);
+        }
+    }, 1);
+
+    vector<unsigned char> header;
+    header.insert(header.end(), { 'T', 'Q', 'O', 'I' });
+    putBigEndian32(header, static_cast<uint32_t>(width));
+    putBigEndian32(header, static_cast<uint32_t>(height));
+    putBigEndian32(header, static_cast<uint32_t>(tileSize));
+    putBigEndian32(header, static_cast<uint32_t>(tileSize));
+    uint64_t offset = header.size() + (static_cast<uint64_t>(count) + 1) * 8;
+    for (int t = 0; t <= count; t++) {
+        putBigEndian32(header, static_cast<uint32_t>(offset >> 32));
+        putBigEndian32(header, static_cast<uint32_t>(offset));
+        if (t < count) offset += tiles[t].size();
+    }
+
+    ofstream file(filename, ios::binary);
+    if (!file.is_open()) {
+        cerr << "Error: Could not create file " << filename << endl;
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(header.data()), header.size());
+    for (const vector<unsigned char>& tile : tiles) {
+        file.write(reinterpret_cast<const char*>(tile.data()), tile.size());
+    }
+    file.close();
+    return true;
+}
+
+/**
+ * Loads a region of a tiled image, decoding only the tiles it touches
+ *
+ * Steps:
+ * 1. Read the header and tile index
+ * 2. Clip the region to the image and find the intersecting tiles
+ * 3. Decode the first tile to learn the channel count and allocate the output
+ * 4. Spread the remaining tiles across threads; each thread opens its own file
+ *    stream, seeks to each tile, decodes it and copies the overlapping pixels
+ *    straight into the output
+ * 5. Return false if the file or any tile is invalid, including a tile whose size
+ *    does not match its slot
+ */
+bool loadTiledRegion(Image& img, const string& filename, Region roi = Region()) {
+    ifstream file(filename, ios::binary);
+    if (!file.is_open()) {
+        cerr << "Error: Could not open file " << filename << endl;
+        return false;
+    }
+    TiledHeader header;
+    if (!readTiledHeader(file, header)) return false;
+    file.close();
+
+    if (roi.width <= 0 || roi.height <= 0) {
+        roi.x = 0;
+        roi.y = 0;
+        roi.width = header.width;
+        roi.height = header.height;
+    }
+    int x0 = max(0, roi.x), y0 = max(0, roi.y);
+    int x1 = min(header.width, roi.x + roi.width), y1 = min(header.height, roi.y + roi.height);
+    if (x0 >= x1 || y0 >= y1) {
+        img = Image(0, 0);
+        return true;
+    }
+
+    int tx0 = x0 / header.tileWidth, tx1 = (x1 - 1) / header.tileWidth;
+    int ty0 = y0 / header.tileHeight, ty1 = (y1 - 1) / header.tileHeight;
+    int columns = tx1 - tx0 + 1;
+    int count = columns * (ty1 - ty0 + 1);
+
+    auto readTile = [&](ifstream& stream, int i, vector<unsigned char>& data, Image& tile) {
+        int tx = tx0 + i % columns, ty = ty0 + i / columns;
+        size_t t = static_cast<size_t>(ty) * header.tilesX + tx;
+        data.resize(static_cast<size_t>(header.offsets[t + 1] - header.offsets[t]));
+        stream.seekg(static_cast<streamoff>(header.offsets[t]));
+        stream.read(reinterpret_cast<char*>(data.data()), data.size());
+        if (!stream || !decodeQOI(data, tile)) return false;
+        // A tile must exactly fill its slot (edge tiles are cut off by the image), so that
+        // copying it never touches pixels that belong to another thread's tiles
+        return tile.getWidth() == min(header.tileWidth, header.width - tx * header.tileWidth) &&
+               tile.getHeight() == min(header.tileHeight, header.height - ty * header.tileHeight);
+    };
+
+    // Channel count comes from the first tile, which is decoded up front
+    ifstream first(filename, ios::binary);
+    vector<unsigned char> data;
+    Image tile;
+    if (!readTile(first, 0, data, tile)) {
+        cerr << "Error: Could not decode tiles of " << filename << endl;
+        return false;
+    }
+    first.close();
+    int channels = tile.getChannels();
+    Image output(x1 - x0, y1 - y0, channels);
+
+    // Copies the part of tile i that falls inside the region
+    auto copyTile = [&](int i, const Image& source) {
+        int tileX = (tx0 + i % columns) * header.tileWidth;
+        int tileY = (ty0 + i / columns) * header.tileHeight;
+        for (int y = max(y0, tileY); y < min(y1, tileY + source.getHeight()); y++) {
+            for (int x = max(x0, tileX); x < min(x1, tileX + source.getWidth()); x++) {
+                for (int c = 0; c < source.getChannels(); c++) {
+                    output(y - y0, x - x0, c) = source(y - tileY, x - tileX, c);
+                }
+            }
+        }
+    };
+    copyTile(0, tile);
+
+    // Remaining tiles are copied as soon as they are decoded, one tile per thread at a time
+    atomic<bool> failed(false);
+    parallelFor(1, count, [&](int i0, int i1) {
+        ifstream stream(filename, ios::binary);
+        vector<unsigned char> bytes;
+        Image decoded;
+        for (int i = i0; i < i1 && !failed; i++) {
+            if (!readTile(stream, i, bytes, decoded) || decoded.getChannels() != channels) {
+                failed = true;
+                break;
+            }
+            copyTile(i, decoded);
+        }
+    }, 1);
+    if (failed) {
+        cerr << "Error: Could not decode tiles of " << filename << endl;
+        return false;
+    }
+
+    img = move(output);
+    return true;
+}
+
+// Loads a whole tiled image, decoding tiles in parallel
+bool loadTiled(Image& img, const string& filename) {
+    return loadTiledRegion(img, filename, Region());
+}
+
+// CRC-32 (as used by PNG chunks), table-driven
+uint32_t crc32Update(uint32_t crc, const unsigned char* data, size_t length) {
+    // Built once; static initialization is thread-safe
+    static const array<uint32_t, 256> table = []() {
+        array<uint32_t, 256> entries;
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            entries[n] = c;
+        }
+        return entries;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Adler-32 (as used by zlib streams)
+uint32_t adler32Update(uint32_t adler, const unsigned char* data, size_t length) {
+    uint32_t a = adler & 0xFFFF, b = adler >> 16;
+    while (length > 0) {
+        size_t block = min<size_t>(length, 5552); // largest block without 32-bit overflow
+        length -= block;
+        while (block--) {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return b << 16 | a;
+}
+
+// Adler-32 of the concatenation of two buffers, from their checksums and the second length
+uint32_t adler32Combine(uint32_t adler1, uint32_t adler2, size_t length2) {
+    const uint32_t base = 65521;
+    uint32_t remainder = static_cast<uint32_t>(length2 % base);
+    uint32_t sum1 = adler1 & 0xFFFF;
+    uint32_t sum2 = static_cast<uint32_t>((static_cast<uint64_t>(remainder) * sum1) % base);
+    sum1 += (adler2 & 0xFFFF) + base - 1;
+    sum2 += ((adler1 >> 16) & 0xFFFF) + ((adler2 >> 16) & 0xFFFF) + base - remainder;
+    if (sum1 >= base) sum1 -= base;
+    if (sum1 >= base) sum1 -= base;
+    if (sum2 >= base << 1) sum2 -= base << 1;
+    if (sum2 >= base) sum2 -= base;
+    return sum2 << 16 | sum1;
+}
+
+// Deflate length and distance code tables (RFC 1951)
+const int deflateLengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+const int deflateLengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+const int deflateDistanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+const int deflateDistanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+const int deflateCodeLengthOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// Writes bits least-significant first, as deflate requires
+class BitWriter {
+private:
+    vector<unsigned char>& out;
+    uint64_t buffer;
+    int count;
+
+public:
+    explicit BitWriter(vector<unsigned char>& target) : out(target), buffer(0), count(0) {}
+
+    void put(uint32_t bits, int length) {
+        buffer |= static_cast<uint64_t>(bits) << count;
+        count += length;
+        while (count >= 8) {
+            out.push_back(static_cast<unsigned char>(buffer));
+            buffer >>= 8;
+            count -= 8;
+        }
+    }
+
+    // Pads with zero bits to the next byte boundary
+    void align() {
+        if (count > 0) put(0, 8 - count);
+    }
+};
+
+// Reverses the lowest length bits of a Huffman code (deflate sends codes MSB first)
+uint32_t reverseCode(uint32_t code, int length) {
+    uint32_t result = 0;
+    for (int i = 0; i < length; i++) {
+        result = result << 1 | (code & 1);
+        code >>= 1;
+    }
+    return result;
+}
+
+/**
+ * Builds length-limited Huffman code lengths from symbol frequencies
+ *
+ * Steps:
+ * 1. Build a Huffman tree by repeatedly merging the two least frequent nodes
+ * 2. Count how many symbols end up at each depth
+ * 3. Move symbols deeper than maxLength up while keeping the code complete
+ *    (the bit-count adjustment from the JPEG standard, Annex K.3)
+ * 4. Hand the shortest lengths to the most frequent symbols
+ *    (at least two symbols always get a code, so the tree is never degenerate)
+ */
+vector<int> buildCodeLengths(vector<long long> frequencies, int maxLength) {
+    int n = static_cast<int>(frequencies.size());
+    vector<int> lengths(n, 0);
+
+    int used = 0;
+    for (long long f : frequencies) used += f > 0;
+    for (int i = 0; i < n && used < 2; i++) {
+        if (frequencies[i] == 0) {
+            frequencies[i] = 1;
+            used++;
+        }
+    }
+
+    // Nodes 0..n-1 are leaves, the rest are internal
+    vector<long long> weight(frequencies);
+    vector<int> parent(n, -1);
+    vector<pair<long long, int>> heap;
+    for (int i = 0; i < n; i++) {
+        if (frequencies[i] > 0) heap.emplace_back(frequencies[i], i);
+    }
+    auto greater = [](const pair<long long, int>& a, const pair<long long, int>& b) { return a > b; };
+    make_heap(heap.begin(), heap.end(), greater);
+    while (heap.size() > 1) {
+        pop_heap(heap.begin(), heap.end(), greater);
+        pair<long long, int> a = heap.back();
+        heap.pop_back();
+        pop_heap(heap.begin(), heap.end(), greater);
+        pair<long long, int> b = heap.back();
+        heap.pop_back();
+        int node = static_cast<int>(weight.size());
+        weight.push_back(a.first + b.first);
+        parent.push_back(-1);
+        parent[a.second] = node;
+        parent[b.second] = node;
+        heap.emplace_back(a.first + b.first, node);
+        push_heap(heap.begin(), heap.end(), greater);
+    }
+
+    vector<int> depthCount(64, 0);
+    vector<int> depth(weight.size(), 0);
+    for (int node = static_cast<int>(weight.size()) - 1; node >= 0; node--) {
+        if (parent[node] >= 0) depth[node] = depth[parent[node]] + 1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (frequencies[i] > 0) depthCount[min(63, depth[i])]++;
+    }
+
+    for (int i = 63; i > maxLength; i--) {
+        while (depthCount[i] > 0) {
+            int j = i - 2;
+            while (depthCount[j] == 0) j--;
+            depthCount[i] -= 2;
+            depthCount[i - 1]++;
+            depthCount[j + 1] += 2;
+            depthCount[j]--;
+        }
+    }
+
+    vector<int> order;
+    for (int i = 0; i < n; i++) {
+        if (frequencies[i] > 0) order.push_back(i);
+    }
+    stable_sort(order.begin(), order.end(), [&](int a, int b) { return frequencies[a] > frequencies[b]; });
+    size_t next = 0;
+    for (int length = 1; length <= maxLength; length++) {
+        for (int k = 0; k < depthCount[length]; k++) {
+            lengths[order[next++]] = length;
+        }
+    }
+    return lengths;
+}
+
+// Canonical Huffman codes (already bit-reversed for the writer) from code lengths
+vector<uint32_t> buildCanonicalCodes(const vector<int>& lengths) {
+    int countPerLength[16] = {};
+    for (int length : lengths) countPerLength[length]++;
+    countPerLength[0] = 0;
+
+    uint32_t nextCode[16] = {};
+    uint32_t code = 0;
+    for (int bits = 1; bits < 16; bits++) {
+        code = (code + countPerLength[bits - 1]) << 1;
+        nextCode[bits] = code;
+    }
+
+    vector<uint32_t> codes(lengths.size(), 0);
+    for (size_t i = 0; i < lengths.size(); i++) {
+        if (lengths[i] > 0) codes[i] = reverseCode(nextCode[lengths[i]]++, lengths[i]);
+    }
+    return codes;
+}
+
+// LZ77 token: literal byte (distance 0) or a (length, distance) match
+struct DeflateToken {
+    unsigned short length;   // literal value when distance is 0
+    unsigned short distance;
+};
+
+int lengthSymbol(int length) {
+    int code = 0;
+    while (code < 28 && deflateLengthBase[code + 1] <= length) code++;
+    return code;
+}
+
+int distanceSymbol(int distance) {
+    int code = 0;
+    while (code < 29 && deflateDistanceBase[code + 1] <= distance) code++;
+    return code;
+}
+
+/**
+ * Writes one dynamic-Huffman deflate block
+ *
+ * Steps:
+ * 1. Count literal/length and distance symbol frequencies, build limited code lengths
+ * 2. Run-length encode the code lengths with symbols 16, 17 and 18, and build the
+ *    code-length code for them
+ * 3. Write the block header, the code-length tables, then every token with its extra bits
+ */
+void writeDynamicBlock(BitWriter& writer, const vector<DeflateToken>& tokens, size_t begin, size_t end, bool final) {
+    vector<long long> literalFrequencies(286, 0), distanceFrequencies(30, 0);
+    for (size_t i = begin; i < end; i++) {
+        if (tokens[i].distance == 0) {
+            literalFrequencies[tokens[i].length]++;
+        }
+        else {
+            literalFrequencies[257 + lengthSymbol(tokens[i].length)]++;
+            distanceFrequencies[distanceSymbol(tokens[i].distance)]++;
+        }
+    }
+    literalFrequencies[256] = 1;
+
+    vector<int> literalLengths = buildCodeLengths(literalFrequencies, 15);
+    vector<int> distanceLengths = buildCodeLengths(distanceFrequencies, 15);
+    vector<uint32_t> literalCodes = buildCanonicalCodes(literalLengths);
+    vector<uint32_t> distanceCodes = buildCanonicalCodes(distanceLengths);
+
+    int literalCount = 286;
+    while (literalCount > 257 && literalLengths[literalCount - 1] == 0) literalCount--;
+    int distanceCount = 30;
+    while (distanceCount > 1 && distanceLengths[distanceCount - 1] == 0) distanceCount--;
+
+    // Run-length encoded code lengths as (symbol, extra bits value)
+    vector<int> all(literalLengths.begin(), literalLengths.begin() + literalCount);
+    all.insert(all.end(), distanceLengths.begin(), distanceLengths.begin() + distanceCount);
+    vector<pair<int, int>> runs;
+    for (size_t i = 0; i < all.size();) {
+        size_t j = i;
+        while (j < all.size() && all[j] == all[i]) j++;
+        int run = static_cast<int>(j - i);
+        if (all[i] == 0) {
+            while (run >= 11) { int r = min(run, 138); runs.emplace_back(18, r - 11); run -= r; }
+            if (run >= 3) { runs.emplace_back(17, run - 3); run = 0; }
+            while (run-- > 0) runs.emplace_back(0, 0);
+        }
+        else {
+            runs.emplace_back(all[i], 0);
+            run--;
+            while (run >= 3) { int r = min(run, 6); runs.emplace_back(16, r - 3); run -= r; }
+            while (run-- > 0) runs.emplace_back(all[i], 0);
+        }
+        i = j;
+    }
+
+    vector<long long> codeLengthFrequencies(19, 0);
+    for (const pair<int, int>& r : runs) codeLengthFrequencies[r.first]++;
+    vector<int> codeLengthLengths = buildCodeLengths(codeLengthFrequencies, 7);
+    vector<uint32_t> codeLengthCodes = buildCanonicalCodes(codeLengthLengths);
+    int codeLengthCount = 19;
+    while (codeLengthCount > 4 && codeLengthLengths[deflateCodeLengthOrder[codeLengthCount - 1]] == 0) codeLengthCount--;
+
+    writer.put(final ? 1 : 0, 1);
+    writer.put(2, 2); // dynamic Huffman
+    writer.put(literalCount - 257, 5);
+    writer.put(distanceCount - 1, 5);
+    writer.put(codeLengthCount - 4, 4);
+    for (int i = 0; i < codeLengthCount; i++) {
+        writer.put(codeLengthLengths[deflateCodeLengthOrder[i]], 3);
+    }
+    for (const pair<int, int>& r : runs) {
+        writer.put(codeLengthCodes[r.first], codeLengthLengths[r.first]);
+        if (r.first == 16) writer.put(r.second, 2);
+        else if (r.first == 17) writer.put(r.second, 3);
+        else if (r.first == 18) writer.put(r.second, 7);
+    }
+
+    for (size_t i = begin; i < end; i++) {
+        const DeflateToken& token = tokens[i];
+        if (token.distance == 0) {
+            writer.put(literalCodes[token.length], literalLengths[token.length]);
+            continue;
+        }
+        int ls = lengthSymbol(token.length);
+        writer.put(literalCodes[257 + ls], literalLengths[257 + ls]);
+        writer.put(token.length - deflateLengthBase[ls], deflateLengthExtra[ls]);
+        int ds = distanceSymbol(token.distance);
+        writer.put(distanceCodes[ds], distanceLengths[ds]);
+        writer.put(token.distance - deflateDistanceBase[ds], deflateDistanceExtra[ds]);
+    }
+    writer.put(literalCodes[256], literalLengths[256]);
+}
+
+/**
+ * Compresses data[begin, end) as a byte-aligned run of deflate blocks
+ *
+ * Steps:
+ * 1. Seed the match finder with up to 32 KB before begin, so matches may reach back
+ *    into the previous chunk (the decompressor sees one continuous stream)
+ * 2. Greedy LZ77: hash the next 3 bytes, follow a short hash chain and take the
+ *    longest match of at least 3 bytes, otherwise emit a literal
+ * 3. Write the tokens as dynamic-Huffman blocks of at most 32K tokens
+ * 4. Non-final chunks end with an empty stored block so the output is byte aligned
+ *    and chunks compressed on different threads can be concatenated (as pigz does)
+ */
+vector<unsigned char> deflateChunk(const vector<unsigned char>& data, size_t begin, size_t end, bool final) {
+    const int windowSize = 32768;
+    const int hashBits = 15;
+    const int maxChain = 16;
+    vector<int> head(1 << hashBits, -1);
+    vector<int> previous(windowSize, -1);
+    size_t base = begin > static_cast<size_t>(windowSize) ? begin - windowSize : 0;
+
+    // Positions are stored relative to base so they fit in int
+    auto hashAt = [&](size_t pos) {
+        return static_cast<int>(((data[pos] << 10) ^ (data[pos + 1] << 5) ^ data[pos + 2]) & ((1 << hashBits) - 1));
+    };
+    auto insert = [&](size_t pos) {
+        if (pos + 2 >= end) return;
+        int h = hashAt(pos);
+        previous[(pos - base) & (windowSize - 1)] = head[h];
+        head[h] = static_cast<int>(pos - base);
+    };
+    for (size_t pos = base; pos < begin; pos++) insert(pos);
+
+    vector<DeflateToken> tokens;
+    tokens.reserve((end - begin) / 2);
+    size_t pos = begin;
+    while (pos < end) {
+        int bestLength = 0, bestDistance = 0;
+        if (pos + 2 < end) {
+            int candidate = head[hashAt(pos)];
+            int maxLength = static_cast<int>(min<size_t>(258, end - pos));
+            for (int chain = 0; chain < maxChain && candidate >= 0; chain++) {
+                size_t match = base + candidate;
+                int distance = static_cast<int>(pos - match);
+                if (distance > windowSize || distance <= 0) break;
+                if (data[match + bestLength] == data[pos + bestLength]) {
+                    int length = 0;
+                    while (length < maxLength && data[match + length] == data[pos + length]) length++;
+                    if (length > bestLength) {
+                        bestLength = length;
+                        bestDistance = distance;
+                        if (length == maxLength) break;
+                    }
+                }
+                candidate = previous[candidate & (windowSize - 1)];
+            }
+        }
+
+        if (bestLength >= 3) {
+            tokens.push_back(DeflateToken{ static_cast<unsigned short>(bestLength), static_cast<unsigned short>(bestDistance) });
+            for (int k = 0; k < bestLength; k++) insert(pos + k);
+            pos += bestLength;
+        }
+        else {
+            tokens.push_back(DeflateToken{ data[pos], 0 });
+            insert(pos);
+            pos++;
+        }
+    }
+
+    vector<unsigned char> out;
+    BitWriter writer(out);
+    const size_t blockTokens = 32768;
+    if (tokens.empty()) {
+        writeDynamicBlock(writer, tokens, 0, 0, final);
+    }
+    for (size_t t = 0; t < tokens.size(); t += blockTokens) {
+        size_t stop = min(tokens.size(), t + blockTokens);
+        writeDynamicBlock(writer, tokens, t, stop, final && stop == tokens.size());
+    }
+    if (!final) {
+        writer.put(0, 3); // empty stored block: BFINAL = 0, BTYPE = 00
+        writer.align();
+        writer.put(0x0000, 16);
+        writer.put(0xFFFF, 16);
+    }
+    writer.align();
+    return out;
+}
+
+/**
+ * Compresses a buffer into a zlib stream using several threads
+ *
+ * Steps:
+ * 1. Split the input into chunks of at least 256 KB, one band per thread
+ * 2. Each thread deflates its chunk (see deflateChunk) and computes its Adler-32
+ * 3. Join the chunks in order behind the zlib header, combine the checksums
+ *    and append the result
+ */
+vector<unsigned char> zlibCompress(const vector<unsigned char>& data) {
+    const int chunkSize = 256 * 1024;
+    int chunks = max(1, static_cast<int>((data.size() + chunkSize - 1) / chunkSize));
+    vector<vector<unsigned char>> compressed(chunks);
+    vector<uint32_t> checksums(chunks);
+
+    parallelFor(0, chunks, [&](int c0, int c1) {
+        for (int c = c0; c < c1; c++) {
+            size_t begin = static_cast<size_t>(c) * chunkSize;
+            size_t end = min(data.size(), begin + chunkSize);
+            compressed[c] = deflateChunk(data, begin, end, c == chunks - 1);
+            checksums[c] = adler32Update(1, data.data() + begin, end - begin);
+        }
+    }, 1);
+
+    vector<unsigned char> out = { 0x78, 0x01 };
+    uint32_t adler = 1;
+    for (int c = 0; c < chunks; c++) {
+        out.insert(out.end(), compressed[c].begin(), compressed[c].end());
+        size_t begin = static_cast<size_t>(c) * chunkSize;
+        adler = adler32Combine(adler, checksums[c], min(data.size(), begin + chunkSize) - begin);
+    }
+    putBigEndian32(out, adler);
+    return out;
+}
+
+// Reads bits least-significant first from a deflate stream
+class BitReader {
+private:
+    const unsigned char* data;
+    size_t size, pos;
+    uint64_t buffer;
+    int count;
+
+public:
+    BitReader(const unsigned char* bytes, size_t length) : data(bytes), size(length), pos(0), buffer(0), count(0) {}
+
+    bool overrun = false;
+
+    uint32_t peek(int length) {
+        while (count < length) {
+            uint64_t byte = 0;
+            if (pos < size) byte = data[pos];
+            else if (pos > size + 8) overrun = true; // allow a little zero padding for peek
+            pos++;
+            buffer |= byte << count;
+            count += 8;
+        }
+        return static_cast<uint32_t>(buffer & ((uint64_t(1) << length) - 1));
+    }
+
+    void skip(int length) {
+        buffer >>= length;
+        count -= length;
+    }
+
+    uint32_t get(int length) {
+        if (length == 0) return 0;
+        uint32_t bits = peek(length);
+        skip(length);
+        return bits;
+    }
+
+    void alignToByte() { skip(count % 8); }
+
+    // Appends length bytes straight from the input; the reader must be byte-aligned
+    bool copyBytes(size_t length, vector<unsigned char>& out) {
+        pos -= count / 8; // hand buffered whole bytes back to the input
+        buffer = 0;
+        count = 0;
+        if (pos > size || length > size - pos) {
+            overrun = true;
+            return false;
+        }
+        out.insert(out.end(), data + pos, data + pos + length);
+        pos += length;
+        return true;
+    }
+};
+
+// Huffman decoding table indexed by the next maxLength bits: entry = symbol << 4 | length
+struct HuffmanTable {
+    int maxLength = 0;
+    vector<uint32_t> entries;
+
+    bool build(const int* lengths, int count) {
+        maxLength = 0;
+        for (int i = 0; i < count; i++) maxLength = max(maxLength, lengths[i]);
+        if (maxLength == 0) {
+            entries.clear();
+            return true;
+        }
+        vector<int> codeLengths(lengths, lengths + count);
+        vector<uint32_t> codes = buildCanonicalCodes(codeLengths);
+        entries.assign(static_cast<size_t>(1) << maxLength, 0);
+        for (int i = 0; i < count; i++) {
+            if (lengths[i] == 0) continue;
+            for (uint32_t fill = codes[i]; fill < entries.size(); fill += 1u << lengths[i]) {
+                entries[fill] = static_cast<uint32_t>(i) << 4 | lengths[i];
+            }
+        }
+        return true;
+    }
+
+    int decode(BitReader& reader) const {
+        if (maxLength == 0) return -1;
+        uint32_t entry = entries[reader.peek(maxLength)];
+        if ((entry & 15) == 0) return -1;
+        reader.skip(entry & 15);
+        return static_cast<int>(entry >> 4);
+    }
+};
+
+/**
+ * Decompresses a zlib stream
+ *
+ * Steps:
+ * 1. Check the 2-byte zlib header
+ * 2. Decode blocks until the final one, stopping as soon as more than maxSize bytes
+ *    would be produced (callers that know the decoded size pass it to bound the work):
+ *    - Stored: copy the raw bytes in one go
+ *    - Fixed or dynamic Huffman: build the decoding tables, then copy literals
+ *      and resolve (length, distance) back-references
+ * 3. Verify the Adler-32 trailer
+ * 4. Return false on malformed or oversized data or a checksum mismatch
+ */
+bool zlibDecompress(const unsigned char* data, size_t size, vector<unsigned char>& out, size_t maxSize = SIZE_MAX) {
+    if (size < 2 || (data[0] & 0x0F) != 8 || ((data[0] << 8) | data[1]) % 31 != 0) {
+        cerr << "Error: Invalid zlib stream" << endl;
+        return false;
+    }
+
+    BitReader reader(data + 2, size - 2);
+    size_t start = out.size();
+    size_t limit = maxSize > SIZE_MAX - start ? SIZE_MAX : start + maxSize;
+    auto tooLarge = [&](size_t length) {
+        if (length <= limit - out.size()) return false;
+        cerr << "Error: zlib data exceeds the expected size" << endl;
+        return true;
+    };
+    bool final = false;
+    while (!final) {
+        final = reader.get(1) == 1;
+        int type = static_cast<int>(reader.get(2));
+
+        if (type == 0) {
+            reader.alignToByte();
+            uint32_t length = reader.get(16);
+            uint32_t inverse = reader.get(16);
+            if ((length ^ 0xFFFF) != inverse || tooLarge(length)) return false;
+            if (!reader.copyBytes(length, out)) return false;
+            continue;
+        }
+        if (type == 3) return false;
+
+        HuffmanTable literals, distances;
+        int lengths[320] = {};
+        if (type == 1) {
+            for (int i = 0; i < 144; i++) lengths[i] = 8;
+            for (int i = 144; i < 256; i++) lengths[i] = 9;
+            for (int i = 256; i < 280; i++) lengths[i] = 7;
+            for (int i = 280; i < 288; i++) lengths[i] = 8;
+            literals.build(lengths, 288);
+            for (int i = 0; i < 30; i++) lengths[i] = 5;
+            distances.build(lengths, 30);
+        }
+        else {
+            int literalCount = static_cast<int>(reader.get(5)) + 257;
+            int distanceCount = static_cast<int>(reader.get(5)) + 1;
+            int codeLengthCount = static_cast<int>(reader.get(4)) + 4;
+            int codeLengthLengths[19] = {};
+            for (int i = 0; i < codeLengthCount; i++) {
+                codeLengthLengths[deflateCodeLengthOrder[i]] = static_cast<int>(reader.get(3));
+            }
+            HuffmanTable codeLengths;
+            codeLengths.build(codeLengthLengths, 19);
+
+            int total = literalCount + distanceCount;
+            for (int i = 0; i < total;) {
+                int symbol = codeLengths.decode(reader);
+                if (symbol < 0 || reader.overrun) return false;
+                if (symbol < 16) {
+                    lengths[i++] = symbol;
+                    continue;
+                }
+                int repeat, value = 0;
+                if (symbol == 16) {
+                    if (i == 0) return false;
+                    value = lengths[i - 1];
+                    repeat = 3 + static_cast<int>(reader.get(2));
+                }
+                else if (symbol == 17) repeat = 3 + static_cast<int>(reader.get(3));
+                else repeat = 11 + static_cast<int>(reader.get(7));
+                if (i + repeat > total) return false;
+                while (repeat--) lengths[i++] = value;
+            }
+            literals.build(lengths, literalCount);
+            distances.build(lengths + literalCount, distanceCount);
+        }
+
+        while (true) {
+            int symbol = literals.decode(reader);
+            if (symbol < 0 || reader.overrun) return false;
+            if (symbol < 256) {
+                if (tooLarge(1)) return false;
+                out.push_back(static_cast<unsigned char>(symbol));
+                continue;
+            }
+            if (symbol == 256) break;
+
+            symbol -= 257;
+            if (symbol >= 29) return false;
+            int length = deflateLengthBase[symbol] + static_cast<int>(reader.get(deflateLengthExtra[symbol]));
+            int ds = distances.decode(reader);
+            if (ds < 0 || ds >= 30) return false;
+            size_t distance = deflateDistanceBase[ds] + reader.get(deflateDistanceExtra[ds]);
+            if (distance > out.size() || tooLarge(length)) return false;
+            size_t from = out.size() - distance;
+            for (int k = 0; k < length; k++) out.push_back(out[from + k]);
+        }
+    }
+
+    reader.alignToByte();
+    uint32_t expected = 0;
+    for (int i = 0; i < 4; i++) expected = expected << 8 | reader.get(8);
+    if (reader.overrun || expected != adler32Update(1, out.data() + start, out.size() - start)) {
+        cerr << "Error: zlib checksum mismatch" << endl;
+        return false;
+    }
+    return true;
+}
+
+// Appends a PNG chunk (length, type, data, CRC)
+void writePNGChunk(vector<unsigned char>& out, const char* type, const unsigned char* data, size_t length) {
+    putBigEndian32(out, static_cast<uint32_t>(length));
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + length);
+    putBigEndian32(out, crc32Update(0, &out[start], length + 4));
+}
+
+// Paeth predictor from the PNG specification
+int paethPredictor(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+/**
+ * Encodes an image as PNG
+ *
+ * Steps:
+ * 1. Pick the color type from the channels (gray, gray + alpha, RGB, RGBA) and the bit
+ *    depth from maxVal (8, or 16 above 255); samples are rescaled if maxVal is not 2^n - 1
+ * 2. Filter every scanline (rows in parallel): try None, Sub, Up, Average and Paeth
+ *    and keep the one with the smallest sum of absolute signed bytes
+ * 3. Compress the filtered scanlines with the multi-threaded zlibCompress
+ * 4. Write the signature and the IHDR, IDAT and IEND chunks
+ */
+vector<unsigned char> encodePNG(const Image& input) {
+    int width = input.getWidth();
+    int height = input.getHeight();
+    int channels = input.getChannels();
+    int maxVal = input.getMaxVal();
+    int depth = maxVal > 255 ? 16 : 8;
+    int target = depth == 16 ? 65535 : 255;
+    int colorTypes[5] = { 0, 0, 4, 2, 6 };
+    int colorType = colorTypes[max(1, min(4, channels))];
+    channels = max(1, min(4, channels));
+    int bytesPerPixel = channels * depth / 8;
+    size_t rowBytes = static_cast<size_t>(width) * bytesPerPixel;
+
+    vector<unsigned char> raw(rowBytes * height);
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            unsigned char* dst = &raw[y * rowBytes];
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < channels; c++) {
+                    int v = max(0, min(maxVal, input(y, x, c)));
+                    if (maxVal != target) v = static_cast<int>((static_cast<long long>(v) * target + maxVal / 2) / maxVal);
+                    if (depth == 16) *dst++ = static_cast<unsigned char>(v >> 8);
+                    *dst++ = static_cast<unsigned char>(v);
+                }
+            }
+        }
+    });
+
+    vector<unsigned char> filtered((rowBytes + 1) * height);
+    parallelFor(0, height, [&](int y0, int y1) {
+        vector<unsigned char> candidate(rowBytes);
+        for (int y = y0; y < y1; y++) {
+            const unsigned char* row = &raw[y * rowBytes];
+            const unsigned char* above = y > 0 ? &raw[(y - 1) * rowBytes] : nullptr;
+            unsigned char* out = &filtered[y * (rowBytes + 1)];
+            long long bestScore = -1;
+
+            for (int filter = 0; filter < 5; filter++) {
+                long long score = 0;
+                for (size_t i = 0; i < rowBytes; i++) {
+                    int a = i >= static_cast<size_t>(bytesPerPixel) ? row[i - bytesPerPixel] : 0;
+                    int b = above ? above[i] : 0;
+                    int c = above && i >= static_cast<size_t>(bytesPerPixel) ? above[i - bytesPerPixel] : 0;
+                    int predicted = 0;
+                    if (filter == 1) predicted = a;
+                    else if (filter == 2) predicted = b;
+                    else if (filter == 3) predicted = (a + b) / 2;
+                    else if (filter == 4) predicted = paethPredictor(a, b, c);
+                    unsigned char value = static_cast<unsigned char>(row[i] - predicted);
+                    candidate[i] = value;
+                    score += value < 128 ? value : 256 - value;
+                }
+                if (bestScore < 0 || score < bestScore) {
+                    bestScore = score;
+                    out[0] = static_cast<unsigned char>(filter);
+                    memcpy(out + 1, candidate.data(), rowBytes);
+                }
+            }
+        }
+    });
+
+    vector<unsigned char> png = { 0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A };
+    vector<unsigned char> header;
+    putBigEndian32(header, static_cast<uint32_t>(width));
+    putBigEndian32(header, static_cast<uint32_t>(height));
+    header.push_back(static_cast<unsigned char>(depth));
+    header.push_back(static_cast<unsigned char>(colorType));
+    header.push_back(0); // deflate
+    header.push_back(0); // adaptive filtering
+    header.push_back(0); // no interlace
+    writePNGChunk(png, "IHDR", header.data(), header.size());
+
+    vector<unsigned char> compressed = zlibCompress(filtered);
+    const size_t maxChunk = 1 << 24;
+    for (size_t offset = 0; offset < compressed.size(); offset += maxChunk) {
+        writePNGChunk(png, "IDAT", compressed.data() + offset, min(maxChunk, compressed.size() - offset));
+    }
+    writePNGChunk(png, "IEND", nullptr, 0);
+    return png;
+}
+
+/**
+ * Decodes a PNG image
+ *
+ * Steps:
+ * 1. Check the signature and read the chunks (IHDR, PLTE, tRNS, IDAT, IEND),
+ *    verifying their CRCs
+ * 2. Inflate the concatenated IDAT data
+ * 3. Undo the per-scanline filters (None, Sub, Up, Average, Paeth)
+ * 4. Unpack the samples: palettes become RGB (RGBA with tRNS), bit depths below 8
+ *    are scaled to 0-255, 16-bit images get maxVal 65535
+ * 5. Return false for invalid files or unsupported features (interlacing)
+ */
+bool decodePNG(const vector<unsigned char>& data, Image& output) {
+    const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A };
+    if (data.size() < 8 || memcmp(data.data(), signature, 8) != 0) {
+        cerr << "Error: Not a PNG file" << endl;
+        return false;
+    }
+
+    int width = 0, height = 0, depth = 0, colorType = 0, interlace = 0;
+    vector<unsigned char> idat, palette, transparency;
+    size_t pos = 8;
+    while (pos + 12 <= data.size()) {
+        uint32_t length = getBigEndian32(&data[pos]);
+        if (pos + 12 + length > data.size()) break;
+        const unsigned char* type = &data[pos + 4];
+        const unsigned char* body = &data[pos + 8];
+        if (crc32Update(0, type, length + 4) != getBigEndian32(body + length)) {
+            cerr << "Error: PNG chunk CRC mismatch" << endl;
+            return false;
+        }
+
+        if (memcmp(type, "IHDR", 4) == 0 && length >= 13) {
+            width = static_cast<int>(getBigEndian32(body));
+            height = static_cast<int>(getBigEndian32(body + 4));
+            depth = body[8];
+            colorType = body[9];
+            interlace = body[12];
+        }
+        else if (memcmp(type, "PLTE", 4) == 0) palette.assign(body, body + length);
+        else if (memcmp(type, "tRNS", 4) == 0) transparency.assign(body, body + length);
+        else if (memcmp(type, "IDAT", 4) == 0) idat.insert(idat.end(), body, body + length);
+        else if (memcmp(type, "IEND", 4) == 0) break;
+        pos += 12 + length;
+    }
+
+    int samplesPerPixel[7] = { 1, 0, 3, 1, 2, 0, 4 };
+    if (width <= 0 || height <= 0 || colorType > 6 || samplesPerPixel[colorType] == 0 ||
+        (depth != 1 && depth != 2 && depth != 4 && depth != 8 && depth != 16)) {
+        cerr << "Error: Unsupported PNG header" << endl;
+        return false;
+    }
+    if (interlace != 0) {
+        cerr << "Error: Interlaced PNG images are not supported" << endl;
+        return false;
+    }
+    if (colorType == 3 && palette.empty()) {
+        cerr << "Error: PNG palette missing" << endl;
+        return false;
+    }
+
+    int samples = samplesPerPixel[colorType];
+    size_t rowBytes = (static_cast<size_t>(width) * samples * depth + 7) / 8;
+    int bytesPerPixel = max(1, samples * depth / 8);
+    vector<unsigned char> raw;
+    raw.reserve((rowBytes + 1) * height);
+    if (!zlibDecompress(idat.data(), idat.size(), raw, (rowBytes + 1) * height) || raw.size() < (rowBytes + 1) * height) {
+        cerr << "Error: Corrupt PNG image data" << endl;
+        return false;
+    }
+
+    // Undo filters in place; each row is predicted from the already reconstructed row above
+    for (int y = 0; y < height; y++) {
+        unsigned char* row = &raw[y * (rowBytes + 1) + 1];
+        const unsigned char* above = y > 0 ? &raw[(y - 1) * (rowBytes + 1) + 1] : nullptr;
+        int filter = row[-1];
+        for (size_t i = 0; i < rowBytes; i++) {
+            int a = i >= static_cast<size_t>(bytesPerPixel) ? row[i - bytesPerPixel] : 0;
+            int b = above ? above[i] : 0;
+            int c = above && i >= static_cast<size_t>(bytesPerPixel) ? above[i - bytesPerPixel] : 0;
+            int predicted = 0;
+            if (filter == 1) predicted = a;
+            else if (filter == 2) predicted = b;
+            else if (filter == 3) predicted = (a + b) / 2;
+            else if (filter == 4) predicted = paethPredictor(a, b, c);
+            else if (filter != 0) {
+                cerr << "Error: Invalid PNG filter" << endl;
+                return false;
+            }
+            row[i] = static_cast<unsigned char>(row[i] + predicted);
+        }
+    }
+
+    bool hasPaletteAlpha = colorType == 3 && !transparency.empty();
+    int channels = colorType == 3 ? (hasPaletteAlpha ? 4 : 3) : samples;
+    reshapeImage(output, width, height, channels, depth == 16 ? 65535 : 255);
+    int lowScale = depth < 8 ? 255 / ((1 << depth) - 1) : 1;
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            const unsigned char* row = &raw[y * (rowBytes + 1) + 1];
+            for (int x = 0; x < width; x++) {
+                for (int s = 0; s < samples; s++) {
+                    size_t index = static_cast<size_t>(x) * samples + s;
+                    int v;
+                    if (depth == 16) v = row[2 * index] << 8 | row[2 * index + 1];
+                    else if (depth == 8) v = row[index];
+                    else {
+                        size_t bit = index * depth;
+                        v = (row[bit / 8] >> (8 - depth - bit % 8)) & ((1 << depth) - 1);
+                    }
+
+                    if (colorType == 3) {
+                        size_t entry = static_cast<size_t>(v);
+                        for (int c = 0; c < 3; c++) {
+                            output(y, x, c) = entry * 3 + c < palette.size() ? palette[entry * 3 + c] : 0;
+                        }
+                        if (hasPaletteAlpha) output(y, x, 3) = entry < transparency.size() ? transparency[entry] : 255;
+                    }
+                    else {
+                        output(y, x, s) = v * lowScale;
+                    }
+                }
+            }
+        }
+    });
+
+    return true;
+}
+
+// Saves an image as a PNG file
+bool savePNG(const Image& img, const string& filename) {
+    vector<unsigned char> data = encodePNG(img);
+    ofstream file(filename, ios::binary);
+    if (!file.is_open()) {
+        cerr << "Error: Could not create file " << filename << endl;
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(data.data()), data.size());
+    file.close();
+    return true;
+}
+
+// Loads a PNG file
+bool loadPNG(Image& img, const string& filename) {
+    ifstream file(filename, ios::binary);
+    if (!file.is_open()) {
+        cerr << "Error: Could not open file " << filename << endl;
+        return false;
+    }
+    vector<unsigned char> data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    return decodePNG(data, img);
+}
+
+// Zigzag scan position -> natural (row-major) coefficient index; padded so corrupt runs stay in range
+const int jpegZigzag[80] = {
+    0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+    63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63
+};
+
+// AAN scale factors: 1 for k = 0, sqrt(2) * cos(k * pi / 16) otherwise
+float aanScaleFactor(int k) {
+    const double pi = 3.14159265358979323846;
+    return k == 0 ? 1.0f : static_cast<float>(sqrt(2.0) * cos(k * pi / 16));
+}
+
+// Huffman table for JPEG entropy data (codes are read most significant bit first)
+struct JPEGHuffmanTable {
+    unsigned short fast[512];   // length << 8 | symbol for codes of up to 9 bits, 0 if longer
+    int maxCode[18];            // largest code of each length, -1 if there is none
+    int valueOffset[17];        // index into values of a code minus the code
+    unsigned char values[256];
+
+    void build(const unsigned char* counts, const unsigned char* symbols) {
+        int total = 0;
+        for (int i = 0; i < 16; i++) total += counts[i];
+        memcpy(values, symbols, min(total, 256));
+        memset(fast, 0, sizeof(fast));
+
+        int code = 0, k = 0;
+        for (int length = 1; length <= 16; length++) {
+            valueOffset[length] = k - code;
+            for (int i = 0; i < counts[length - 1] && k < 256; i++, k++, code++) {
+                if (length <= 9) {
+                    int first = code << (9 - length);
+                    for (int j = 0; j < 1 << (9 - length); j++) {
+                        fast[first + j] = static_cast<unsigned short>(length << 8 | values[k]);
+                    }
+                }
+            }
+            maxCode[length] = counts[length - 1] ? code - 1 : -1;
+            code <<= 1;
+        }
+        maxCode[17] = INT32_MAX;
+    }
+};
+
+// Reads entropy-coded JPEG data, removing stuffed zero bytes; past the end it supplies zeros
+class JPEGBitReader {
+private:
+    const unsigned char* data;
+    size_t pos, end;
+    uint32_t buffer;
+    int count;
+
+    void fill() {
+        while (count <= 24) {
+            uint32_t byte = 0;
+            if (pos < end) {
+                byte = data[pos++];
+                if (byte == 0xFF && pos < end && data[pos] == 0) pos++;
+            }
+            buffer |= byte << (24 - count);
+            count += 8;
+        }
+    }
+
+public:
+    JPEGBitReader(const unsigned char* bytes, size_t begin, size_t stop) : data(bytes), pos(begin), end(stop), buffer(0), count(0) {}
+
+    int get(int length) {
+        if (length == 0) return 0;
+        fill();
+        int bits = static_cast<int>(buffer >> (32 - length));
+        buffer <<= length;
+        count -= length;
+        return bits;
+    }
+
+    // Reads length bits and sign-extends them as in the JPEG EXTEND procedure
+    int receiveExtend(int length) {
+        if (length == 0) return 0;
+        int bits = get(length);
+        return bits < 1 << (length - 1) ? bits - (1 << length) + 1 : bits;
+    }
+
+    int decode(const JPEGHuffmanTable& table) {
+        fill();
+        int entry = table.fast[buffer >> 23];
+        if (entry != 0) {
+            buffer <<= entry >> 8;
+            count -= entry >> 8;
+            return entry & 0xFF;
+        }
+        int code = static_cast<int>(buffer >> 16);
+        for (int length = 10; length <= 16; length++) {
+            int prefix = code >> (16 - length);
+            if (prefix <= table.maxCode[length]) {
+                buffer <<= length;
+                count -= length;
+                return table.values[(prefix + table.valueOffset[length]) & 0xFF];
+            }
+        }
+        buffer <<= 16; // invalid code: consume it and let the caller produce garbage, not a crash
+        count -= 16;
+        return 0;
+    }
+};
+
+// Class to decode baseline and progressive JPEG images, optionally at 1/2, 1/4 or 1/8 scale
+class JPEGDecoder {
+private:
+    struct Component {
+        int id = 0, h = 1, v = 1;
+        int quantTable = 0, dcTable = 0, acTable = 0;
+        int blocksPerLine = 0, blocksPerColumn = 0;  // MCU-padded block grid
+        int usedBlocksX = 0, usedBlocksY = 0;         // blocks covering the real component size
+        int scaledWidth = 8, scaledHeight = 8;        // samples each block is transformed to
+        vector<short> coefficients;                   // progressive mode: 64 per block
+        vector<unsigned char> plane;                  // decoded samples at the output scale
+    };
+
+    // Entropy decoder state that restarts at every restart marker
+    struct ScanState {
+        int dcPredictors[4] = {};
+        int eobRun = 0;
+    };
+
+    int width = 0, height = 0;
+    int maxH = 1, maxV = 1, mcusX = 0, mcusY = 0;
+    int restartInterval = 0;
+    int blockSize = 8;          // output samples per block side: 8 / scale
+    float reduction[4][8][8];   // [log2 n][x][u]: n-point outputs as box averages of the 8-point IDCT
+    int adobeTransform = -1;
+    bool progressive = false;
+    bool frameSeen = false;
+    unsigned short quant[4][64] = {};
+    float idctMultipliers[4][64] = {};  // quant * AAN row and column factors / 8
+    JPEGHuffmanTable dcTables[4], acTables[4];
+    vector<Component> components;
+
+    // Scan parameters
+    vector<int> scanComponents;
+    int spectralStart = 0, spectralEnd = 63, approxHigh = 0, approxLow = 0;
+
+    bool parseFrame(const unsigned char* p, int length) {
+        if (length < 6 || p[0] != 8) {
+            cerr << "Error: Only 8-bit JPEG images are supported" << endl;
+            return false;
+        }
+        height = p[1] << 8 | p[2];
+        width = p[3] << 8 | p[4];
+        int count = p[5];
+        if (width == 0 || height == 0 || (count != 1 && count != 3 && count != 4) || length < 6 + 3 * count) {
+            cerr << "Error: Unsupported JPEG frame" << endl;
+            return false;
+        }
+
+        components.assign(count, Component());
+        maxH = maxV = 1;
+        for (int i = 0; i < count; i++) {
+            Component& comp = components[i];
+            comp.id = p[6 + 3 * i];
+            comp.h = p[7 + 3 * i] >> 4;
+            comp.v = p[7 + 3 * i] & 15;
+            comp.quantTable = p[8 + 3 * i] & 3;
+            if (comp.h < 1 || comp.h > 4 || comp.v < 1 || comp.v > 4) {
+                cerr << "Error: Invalid JPEG sampling factors" << endl;
+                return false;
+            }
+            maxH = max(maxH, comp.h);
+            maxV = max(maxV, comp.v);
+        }
+
+        // Subsampled components get larger transforms when scaling down, so that (like libjpeg)
+        // 4:2:0 chroma decoded at 1/8 comes out at 2 x 2 per block instead of being upsampled
+        auto scaledSize = [&](int factor, int maxFactor) {
+            int size = blockSize;
+            while (size < 8 && factor * size * 2 <= maxFactor * blockSize) size *= 2;
+            return size;
+        };
+        mcusX = (width + 8 * maxH - 1) / (8 * maxH);
+        mcusY = (height + 8 * maxV - 1) / (8 * maxV);
+        for (Component& comp : components) {
+            comp.blocksPerLine = mcusX * comp.h;
+            comp.blocksPerColumn = mcusY * comp.v;
+            comp.usedBlocksX = ((width * comp.h + maxH - 1) / maxH + 7) / 8;
+            comp.usedBlocksY = ((height * comp.v + maxV - 1) / maxV + 7) / 8;
+            comp.scaledWidth = scaledSize(comp.h, maxH);
+            comp.scaledHeight = scaledSize(comp.v, maxV);
+            size_t blocks = static_cast<size_t>(comp.blocksPerLine) * comp.blocksPerColumn;
+            comp.plane.assign(blocks * comp.scaledWidth * comp.scaledHeight, 0);
+            if (progressive) comp.coefficients.assign(blocks * 64, 0);
+        }
+        frameSeen = true;
+        return true;
+    }
+
+    bool parseHuffmanTables(const unsigned char* p, int length) {
+        while (length >= 17) {
+            int type = p[0] >> 4, index = p[0] & 3;
+            int total = 0;
+            for (int i = 0; i < 16; i++) total += p[1 + i];
+            if (17 + total > length || total > 256) return false;
+            (type == 0 ? dcTables[index] : acTables[index]).build(p + 1, p + 17);
+            p += 17 + total;
+            length -= 17 + total;
+        }
+        return true;
+    }
+
+    bool parseQuantTables(const unsigned char* p, int length) {
+        while (length >= 65) {
+            int precision = p[0] >> 4, index = p[0] & 3;
+            if (length < 1 + 64 * (precision + 1)) return false;
+            for (int k = 0; k < 64; k++) {
+                quant[index][jpegZigzag[k]] = precision ? static_cast<unsigned short>(p[1 + 2 * k] << 8 | p[2 + 2 * k]) : p[1 + k];
+            }
+            for (int i = 0; i < 64; i++) {
+                idctMultipliers[index][i] = quant[index][i] * aanScaleFactor(i >> 3) * aanScaleFactor(i & 7) * 0.125f;
+            }
+            p += 1 + 64 * (precision + 1);
+            length -= 1 + 64 * (precision + 1);
+        }
+        return true;
+    }
+
+    // Baseline: Huffman-decode one block into natural order; returns false if all AC terms are zero
+    bool decodeBaselineBlock(JPEGBitReader& reader, const Component& comp, int& predictor, short* block) {
+        memset(block, 0, 64 * sizeof(short));
+        int s = reader.decode(dcTables[comp.dcTable]) & 15; // categories above 11 only occur in corrupt data
+        predictor += reader.receiveExtend(s);
+        block[0] = static_cast<short>(predictor);
+
+        bool hasAC = false;
+        const JPEGHuffmanTable& ac = acTables[comp.acTable];
+        for (int k = 1; k < 64;) {
+            int rs = reader.decode(ac);
+            int run = rs >> 4, size = rs & 15;
+            if (size == 0) {
+                if (run != 15) break;
+                k += 16;
+                continue;
+            }
+            k += run;
+            block[jpegZigzag[k]] = static_cast<short>(reader.receiveExtend(size));
+            hasAC = true;
+            k++;
+        }
+        return hasAC;
+    }
+
+    // Progressive: one block of the current scan, refining the stored coefficients
+    void decodeProgressiveBlock(JPEGBitReader& reader, const Component& comp, int& predictor, int& eobRun, short* block) {
+        if (spectralStart == 0) {
+            if (approxHigh == 0) {
+                int s = reader.decode(dcTables[comp.dcTable]) & 15;
+                predictor += reader.receiveExtend(s);
+                block[0] = static_cast<short>(predictor * (1 << approxLow));
+            }
+            else if (reader.get(1)) {
+                block[0] = static_cast<short>(block[0] | (1 << approxLow));
+            }
+            return;
+        }
+
+        const JPEGHuffmanTable& ac = acTables[comp.acTable];
+        if (approxHigh == 0) {
+            if (eobRun > 0) {
+                eobRun--;
+                return;
+            }
+            for (int k = spectralStart; k <= spectralEnd;) {
+                int rs = reader.decode(ac);
+                int run = rs >> 4, size = rs & 15;
+                if (size == 0) {
+                    if (run < 15) {
+                        eobRun = (1 << run) - 1 + reader.get(run);
+                        break;
+                    }
+                    k += 16;
+                    continue;
+                }
+                k += run;
+                block[jpegZigzag[k]] = static_cast<short>(reader.receiveExtend(size) * (1 << approxLow));
+                k++;
+            }
+            return;
+        }
+
+        // Successive approximation refinement of AC coefficients
+        int plus = 1 << approxLow, minus = -1 * (1 << approxLow);
+        int k = spectralStart;
+        auto refine = [&](short& coef) {
+            if (reader.get(1) && (coef & plus) == 0) coef = static_cast<short>(coef + (coef >= 0 ? plus : minus));
+        };
+        if (eobRun == 0) {
+            for (; k <= spectralEnd; k++) {
+                int rs = reader.decode(ac);
+                int run = rs >> 4, size = rs & 15;
+                int value = 0;
+                if (size != 0) {
+                    value = reader.get(1) ? plus : minus;
+                }
+                else if (run != 15) {
+                    eobRun = (1 << run) + reader.get(run);
+                    break;
+                }
+                while (k <= spectralEnd) {
+                    short& coef = block[jpegZigzag[k]];
+                    if (coef != 0) refine(coef);
+                    else if (--run < 0) break;
+                    k++;
+                }
+                if (value != 0 && k <= spectralEnd) block[jpegZigzag[k]] = static_cast<short>(value);
+            }
+        }
+        if (eobRun > 0) {
+            for (; k <= spectralEnd; k++) {
+                short& coef = block[jpegZigzag[k]];
+                if (coef != 0) refine(coef);
+            }
+            eobRun--;
+        }
+    }
+
+    /**
+     * Inverse DCT of one dequantized block into the component's scaled block size
+     *
+     * Full size uses the AAN float IDCT; each pass runs over all 8 columns at once so the
+     * compiler can vectorize it. Reduced sizes apply the reduction matrices, giving the exact
+     * box average of the full IDCT over each output sample; 1 x 1 is just the DC term.
+     */
+    void inverseDCT(const short* block, const Component& comp, bool hasAC, unsigned char* out, int stride) const {
+        const unsigned short* q = quant[comp.quantTable];
+        int nx = comp.scaledWidth, ny = comp.scaledHeight;
+        if (!hasAC || (nx == 1 && ny == 1)) {
+            unsigned char dc = static_cast<unsigned char>(max(0, min(255, static_cast<int>(lround(block[0] * q[0] / 8.0 + 128)))));
+            for (int y = 0; y < ny; y++) memset(out + y * stride, dc, nx);
+            return;
+        }
+
+        float work[64];
+        if (nx == 8 && ny == 8) {
+            const float* multipliers = idctMultipliers[comp.quantTable];
+            for (int i = 0; i < 64; i++) work[i] = block[i] * multipliers[i];
+            for (int pass = 0; pass < 2; pass++) {
+                float* w = work;
+                for (int i = 0; i < 8; i++) {
+                    float tmp10 = w[i] + w[32 + i], tmp11 = w[i] - w[32 + i];
+                    float tmp13 = w[16 + i] + w[48 + i];
+                    float tmp12 = (w[16 + i] - w[48 + i]) * 1.414213562f - tmp13;
+                    float tmp0 = tmp10 + tmp13, tmp3 = tmp10 - tmp13;
+                    float tmp1 = tmp11 + tmp12, tmp2 = tmp11 - tmp12;
+
+                    float z13 = w[40 + i] + w[24 + i], z10 = w[40 + i] - w[24 + i];
+                    float z11 = w[8 + i] + w[56 + i], z12 = w[8 + i] - w[56 + i];
+                    float tmp7 = z11 + z13;
+                    float tmp11b = (z11 - z13) * 1.414213562f;
+                    float z5 = (z10 + z12) * 1.847759065f;
+                    float tmp10b = z5 - z12 * 1.082392200f;
+                    float tmp12b = z5 - z10 * 2.613125930f;
+                    float tmp6 = tmp12b - tmp7;
+                    float tmp5 = tmp11b - tmp6;
+                    float tmp4 = tmp10b - tmp5;
+
+                    w[i] = tmp0 + tmp7;       w[56 + i] = tmp0 - tmp7;
+                    w[8 + i] = tmp1 + tmp6;   w[48 + i] = tmp1 - tmp6;
+                    w[16 + i] = tmp2 + tmp5;  w[40 + i] = tmp2 - tmp5;
+                    w[24 + i] = tmp3 + tmp4;  w[32 + i] = tmp3 - tmp4;
+                }
+                for (int r = 0; r < 8; r++) {
+                    for (int c = r + 1; c < 8; c++) swap(work[r * 8 + c], work[c * 8 + r]);
+                }
+            }
+        }
+        else {
+            const float (*rowMatrix)[8] = reduction[nx == 1 ? 0 : nx == 2 ? 1 : nx == 4 ? 2 : 3];
+            const float (*columnMatrix)[8] = reduction[ny == 1 ? 0 : ny == 2 ? 1 : ny == 4 ? 2 : 3];
+            float rows[8][8];
+            for (int v = 0; v < 8; v++) {
+                float dequantized[8];
+                for (int u = 0; u < 8; u++) dequantized[u] = static_cast<float>(block[v * 8 + u] * q[v * 8 + u]);
+                for (int x = 0; x < nx; x++) {
+                    float sum = 0;
+                    for (int u = 0; u < 8; u++) sum += rowMatrix[x][u] * dequantized[u];
+                    rows[v][x] = sum;
+                }
+            }
+            for (int y = 0; y < ny; y++) {
+                for (int x = 0; x < nx; x++) {
+                    float sum = 0;
+                    for (int v = 0; v < 8; v++) sum += columnMatrix[y][v] * rows[v][x];
+                    work[y * 8 + x] = sum;
+                }
+            }
+        }
+
+        for (int y = 0; y < ny; y++) {
+            for (int x = 0; x < nx; x++) {
+                out[y * stride + x] = static_cast<unsigned char>(max(0, min(255, static_cast<int>(lround(work[y * 8 + x] + 128)))));
+            }
+        }
+    }
+
+    // Block (bx, by) of a component, addressed in the MCU-padded grid
+    unsigned char* planeBlock(Component& comp, int bx, int by) {
+        size_t stride = static_cast<size_t>(comp.blocksPerLine) * comp.scaledWidth;
+        return &comp.plane[static_cast<size_t>(by) * comp.scaledHeight * stride + static_cast<size_t>(bx) * comp.scaledWidth];
+    }
+
+    // Decodes MCUs [begin, end) of the current scan from one restart segment
+    void decodeSegment(const unsigned char* data, size_t segmentBegin, size_t segmentEnd, int begin, int end) {
+        JPEGBitReader reader(data, segmentBegin, segmentEnd);
+        ScanState state;
+        short block[64];
+        bool interleaved = scanComponents.size() > 1;
+
+        for (int mcu = begin; mcu < end; mcu++) {
+            for (size_t s = 0; s < scanComponents.size(); s++) {
+                Component& comp = components[scanComponents[s]];
+                int blocksH = interleaved ? comp.h : 1, blocksV = interleaved ? comp.v : 1;
+                for (int by = 0; by < blocksV; by++) {
+                    for (int bx = 0; bx < blocksH; bx++) {
+                        int x, y;
+                        if (interleaved) {
+                            x = (mcu % mcusX) * comp.h + bx;
+                            y = (mcu / mcusX) * comp.v + by;
+                        }
+                        else {
+                            x = mcu % comp.usedBlocksX;
+                            y = mcu / comp.usedBlocksX;
+                        }
+
+                        if (progressive) {
+                            short* stored = &comp.coefficients[(static_cast<size_t>(y) * comp.blocksPerLine + x) * 64];
+                            decodeProgressiveBlock(reader, comp, state.dcPredictors[s], state.eobRun, stored);
+                        }
+                        else {
+                            bool hasAC = decodeBaselineBlock(reader, comp, state.dcPredictors[s], block);
+                            inverseDCT(block, comp, hasAC, planeBlock(comp, x, y), comp.blocksPerLine * comp.scaledWidth);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * Decodes one scan whose entropy-coded data starts at pos
+     *
+     * Steps:
+     * 1. Split the data at restart markers (RSTn) and find the marker that ends the scan
+     * 2. Skip progressive AC scans of components decoded at 1 x 1 (DC only)
+     * 3. Decode the segments; with restart intervals they are independent and run in parallel
+     */
+    size_t decodeScan(const vector<unsigned char>& data, size_t pos) {
+        vector<pair<size_t, size_t>> segments;
+        size_t start = pos;
+        while (pos + 1 < data.size()) {
+            if (data[pos] != 0xFF || data[pos + 1] == 0x00) {
+                pos += data[pos] == 0xFF ? 2 : 1;
+                continue;
+            }
+            int marker = data[pos + 1];
+            if (marker >= 0xD0 && marker <= 0xD7) {
+                segments.emplace_back(start, pos);
+                pos += 2;
+                start = pos;
+                continue;
+            }
+            if (marker == 0xFF) {
+                pos++; // fill byte
+                continue;
+            }
+            break;
+        }
+        segments.emplace_back(start, min(pos, data.size()));
+
+        const Component& first = components[scanComponents[0]];
+        if (progressive && spectralStart > 0 && first.scaledWidth == 1 && first.scaledHeight == 1) return pos;
+
+        int totalMCUs;
+        if (scanComponents.size() > 1) totalMCUs = mcusX * mcusY;
+        else totalMCUs = components[scanComponents[0]].usedBlocksX * components[scanComponents[0]].usedBlocksY;
+        int interval = restartInterval > 0 ? restartInterval : totalMCUs;
+
+        parallelFor(0, static_cast<int>(segments.size()), [&](int s0, int s1) {
+            for (int s = s0; s < s1; s++) {
+                int begin = min(totalMCUs, s * interval);
+                int end = s + 1 == static_cast<int>(segments.size()) ? totalMCUs : min(totalMCUs, begin + interval);
+                decodeSegment(data.data(), segments[s].first, segments[s].second, begin, end);
+            }
+        }, 1);
+        return pos;
+    }
+
+    // Progressive mode: dequantize and transform every stored block once all scans are in
+    void transformCoefficients() {
+        for (Component& comp : components) {
+            int stride = comp.blocksPerLine * comp.scaledWidth;
+            parallelFor(0, comp.usedBlocksY, [&](int y0, int y1) {
+                for (int by = y0; by < y1; by++) {
+                    for (int bx = 0; bx < comp.usedBlocksX; bx++) {
+                        const short* block = &comp.coefficients[(static_cast<size_t>(by) * comp.blocksPerLine + bx) * 64];
+                        bool hasAC = false;
+                        for (int i = 1; i < 64 && !hasAC; i++) hasAC = block[i] != 0;
+                        inverseDCT(block, comp, hasAC, planeBlock(comp, bx, by), stride);
+                    }
+                }
+            }, 1);
+        }
+    }
+
+    /**
+     * Builds the output image from the component planes
+     *
+     * Steps:
+     * 1. For components still below output resolution precompute, per output column and row,
+     *    the two nearest samples and a linear weight (centered siting, as in JFIF)
+     * 2. Per output row, upsample and convert in a single pass: YCbCr -> RGB in 16-bit
+     *    fixed point, RGB copied, Adobe CMYK/YCCK multiplied through K, gray copied
+     */
+    void convertToImage(int scale, Image& output) {
+        int outWidth = (width + scale - 1) / scale;
+        int outHeight = (height + scale - 1) / scale;
+        int count = static_cast<int>(components.size());
+        reshapeImage(output, outWidth, outHeight, count == 1 ? 1 : 3);
+
+        struct Axis { vector<int> index0, index1, weight; };
+        // density / outputDensity = component samples per output sample
+        auto buildAxis = [](int outSize, int density, int outputDensity, int available) {
+            Axis axis;
+            int size = max(1, min(available, (outSize * density + outputDensity - 1) / outputDensity));
+            for (int i = 0; i < outSize; i++) {
+                float p = (i + 0.5f) * density / outputDensity - 0.5f;
+                int i0 = static_cast<int>(floor(p));
+                int w = static_cast<int>(lround((p - i0) * 256));
+                if (i0 < 0) { i0 = 0; w = 0; }
+                axis.index0.push_back(min(i0, size - 1));
+                axis.index1.push_back(min(i0 + 1, size - 1));
+                axis.weight.push_back(w);
+            }
+            return axis;
+        };
+        vector<Axis> columns, rows;
+        for (Component& comp : components) {
+            columns.push_back(buildAxis(outWidth, comp.h * comp.scaledWidth, maxH * blockSize, comp.blocksPerLine * comp.scaledWidth));
+            rows.push_back(buildAxis(outHeight, comp.v * comp.scaledHeight, maxV * blockSize, comp.blocksPerColumn * comp.scaledHeight));
+        }
+
+        bool rgb = count == 3 && (adobeTransform == 0 || (components[0].id == 'R' && components[1].id == 'G' && components[2].id == 'B'));
+
+        parallelFor(0, outHeight, [&](int y0, int y1) {
+            vector<vector<int>> samples(count, vector<int>(outWidth));
+            for (int y = y0; y < y1; y++) {
+                for (int c = 0; c < count; c++) {
+                    const Component& comp = components[c];
+                    int stride = comp.blocksPerLine * comp.scaledWidth;
+                    vector<int>& line = samples[c];
+                    if (comp.h * comp.scaledWidth == maxH * blockSize && comp.v * comp.scaledHeight == maxV * blockSize) {
+                        const unsigned char* src = &comp.plane[static_cast<size_t>(y) * stride];
+                        for (int x = 0; x < outWidth; x++) line[x] = src[x];
+                        continue;
+                    }
+                    const unsigned char* top = &comp.plane[static_cast<size_t>(rows[c].index0[y]) * stride];
+                    const unsigned char* bottom = &comp.plane[static_cast<size_t>(rows[c].index1[y]) * stride];
+                    int wy = rows[c].weight[y];
+                    const Axis& cols = columns[c];
+                    for (int x = 0; x < outWidth; x++) {
+                        int wx = cols.weight[x];
+                        int upper = top[cols.index0[x]] * (256 - wx) + top[cols.index1[x]] * wx;
+                        int lower = bottom[cols.index0[x]] * (256 - wx) + bottom[cols.index1[x]] * wx;
+                        line[x] = (upper * (256 - wy) + lower * wy + 32768) >> 16;
+                    }
+                }
+
+                for (int x = 0; x < outWidth; x++) {
+                    if (count == 1) {
+                        output(y, x, 0) = samples[0][x];
+                        continue;
+                    }
+                    int r = samples[0][x], g = samples[1][x], b = samples[2][x];
+                    bool ycc = !rgb && (count == 3 || adobeTransform == 2);
+                    if (ycc) {
+                        int luma = samples[0][x], cb = samples[1][x] - 128, cr = samples[2][x] - 128;
+                        r = max(0, min(255, luma + ((91881 * cr + 32768) >> 16)));
+                        g = max(0, min(255, luma - ((22554 * cb + 46802 * cr + 32768) >> 16)));
+                        b = max(0, min(255, luma + ((116130 * cb + 32768) >> 16)));
+                    }
+                    if (count == 4) {
+                        // Adobe stores inverted CMYK; YCCK decodes to non-inverted CMY
+                        int k = samples[3][x];
+                        if (ycc) {
+                            r = 255 - r;
+                            g = 255 - g;
+                            b = 255 - b;
+                        }
+                        r = (r * k + 127) / 255;
+                        g = (g * k + 127) / 255;
+                        b = (b * k + 127) / 255;
+                    }
+                    output(y, x, 0) = r;
+                    output(y, x, 1) = g;
+                    output(y, x, 2) = b;
+                }
+            }
+        });
+    }
+
+public:
+    /**
+     * Decodes a JPEG image
+     *
+     * Steps:
+     * 1. Walk the markers: DQT, DHT, DRI, SOF0/SOF1 (baseline), SOF2 (progressive), APP14 (Adobe)
+     * 2. Decode each scan until EOI (see decodeScan); baseline scans, interleaved or one per
+     *    component, transform blocks as they are decoded
+     * 3. Progressive images are transformed after the last scan
+     * 4. Upsample and convert to RGB or gray (see convertToImage)
+     *
+     * scale may be 1, 2, 4 or 8; the output is then ceil(width / scale) x ceil(height / scale)
+     * and each block is transformed straight to that size.
+     */
+    bool decode(const vector<unsigned char>& data, Image& output, int scale = 1) {
+        if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+            cerr << "Error: JPEG scale must be 1, 2, 4 or 8" << endl;
+            return false;
+        }
+        if (data.size() < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+            cerr << "Error: Not a JPEG file" << endl;
+            return false;
+        }
+        blockSize = 8 / scale;
+        const double pi = 3.14159265358979323846;
+        for (int level = 0; level < 4; level++) {
+            int n = 1 << level, span = 8 / n;
+            for (int x = 0; x < n; x++) {
+                for (int u = 0; u < 8; u++) {
+                    double sum = 0;
+                    for (int k = x * span; k < (x + 1) * span; k++) sum += cos((2 * k + 1) * u * pi / 16);
+                    reduction[level][x][u] = static_cast<float>(0.5 * (u == 0 ? sqrt(0.5) : 1.0) * sum / span);
+                }
+            }
+        }
+
+        size_t pos = 2;
+        while (pos + 4 <= data.size()) {
+            if (data[pos] != 0xFF) {
+                pos++;
+                continue;
+            }
+            int marker = data[pos + 1];
+            if (marker == 0xFF) {
+                pos++;
+                continue;
+            }
+            if (marker == 0xD9) break;
+            if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+                pos += 2;
+                continue;
+            }
+
+            int length = data[pos + 2] << 8 | data[pos + 3];
+            if (length < 2 || pos + 2 + length > data.size()) {
+                cerr << "Error: Truncated JPEG segment" << endl;
+                return false;
+            }
+            const unsigned char* body = &data[pos + 4];
+            int bodyLength = length - 2;
+            pos += 2 + length;
+
+            bool ok = true;
+            switch (marker) {
+            case 0xC0:
+            case 0xC1:
+            case 0xC2:
+                progressive = marker == 0xC2;
+                ok = parseFrame(body, bodyLength);
+                break;
+            case 0xC4:
+                ok = parseHuffmanTables(body, bodyLength);
+                break;
+            case 0xDB:
+                ok = parseQuantTables(body, bodyLength);
+                break;
+            case 0xDD:
+                restartInterval = bodyLength >= 2 ? body[0] << 8 | body[1] : 0;
+                break;
+            case 0xEE:
+                if (bodyLength >= 12 && memcmp(body, "Adobe", 5) == 0) adobeTransform = body[11];
+                break;
+            case 0xDA: {
+                int count = bodyLength > 0 ? body[0] : 0;
+                if (!frameSeen || count < 1 || count > 4 || bodyLength < 4 + 2 * count) {
+                    ok = false;
+                    break;
+                }
+                scanComponents.clear();
+                for (int i = 0; i < count; i++) {
+                    int id = body[1 + 2 * i];
+                    int index = -1;
+                    for (size_t c = 0; c < components.size(); c++) {
+                        if (components[c].id == id) index = static_cast<int>(c);
+                    }
+                    if (index < 0) {
+                        ok = false;
+                        break;
+                    }
+                    components[index].dcTable = (body[2 + 2 * i] >> 4) & 3;
+                    components[index].acTable = body[2 + 2 * i] & 3;
+                    scanComponents.push_back(index);
+                }
+                spectralStart = body[1 + 2 * count];
+                spectralEnd = min(63, static_cast<int>(body[2 + 2 * count]));
+                approxHigh = body[3 + 2 * count] >> 4;
+                approxLow = body[3 + 2 * count] & 15;
+                if (ok) pos = decodeScan(data, pos);
+                break;
+            }
+            default:
+                if ((marker >= 0xC3 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)) {
+                    cerr << "Error: Unsupported JPEG coding process (lossless, hierarchical or arithmetic)" << endl;
+                    return false;
+                }
+                break; // APPn, COM and others are skipped
+            }
+            if (!ok) {
+                cerr << "Error: Invalid JPEG data" << endl;
+                return false;
+            }
+        }
+
+        if (!frameSeen) {
+            cerr << "Error: JPEG image has no frame" << endl;
+            return false;
+        }
+        if (progressive) transformCoefficients();
+        convertToImage(scale, output);
+        return true;
+    }
+};
+
+// Decodes JPEG data into an image, optionally at 1/2, 1/4 or 1/8 scale
+bool decodeJPEG(const vector<unsigned char>& data, Image& output, int scale = 1) {
+    JPEGDecoder decoder;
+    return decoder.decode(data, output, scale);
+}
+
+// Loads a JPEG file
+bool loadJPEG(Image& img, const string& filename, int scale = 1) {
+    ifstream file(filename, ios::binary);
+    if (!file.is_open()) {
+        cerr << "Error: Could not open file " << filename << endl;
+        return false;
+    }
+    vector<unsigned char> data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    return decodeJPEG(data, img, scale);
+}
+
+// Standard quantization and Huffman tables (JPEG Annex K), quantization in natural order
+const unsigned char jpegLumaQuant[64] = {
+    16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55,
+    14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62,
+    18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99
+};
+const unsigned char jpegChromaQuant[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99
+};
+const unsigned char jpegLumaDCBits[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+const unsigned char jpegChromaDCBits[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+const unsigned char jpegDCValues[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+const unsigned char jpegLumaACBits[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7D };
+const unsigned char jpegLumaACValues[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08, 0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0A, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7,
+    0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5,
+    0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2,
+    0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+    0xF9, 0xFA
+};
+const unsigned char jpegChromaACBits[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+const unsigned char jpegChromaACValues[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33, 0x52, 0xF0,
+    0x15, 0x62, 0x72, 0xD1, 0x0A, 0x16, 0x24, 0x34, 0xE1, 0x25, 0xF1, 0x17, 0x18, 0x19, 0x1A, 0x26,
+    0x27, 0x28, 0x29, 0x2A, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5,
+    0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3,
+    0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
+    0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+    0xF9, 0xFA
+};
+
+// Writes JPEG entropy-coded data: most significant bit first, 0xFF bytes followed by a stuffed 0x00
+class JPEGBitWriter {
+private:
+    vector<unsigned char>& out;
+    uint32_t buffer;
+    int count;
+
+public:
+    explicit JPEGBitWriter(vector<unsigned char>& target) : out(target), buffer(0), count(0) {}
+
+    void put(uint32_t bits, int length) {
+        buffer = buffer << length | (bits & ((1u << length) - 1));
+        count += length;
+        while (count >= 8) {
+            unsigned char byte = static_cast<unsigned char>(buffer >> (count - 8));
+            out.push_back(byte);
+            if (byte == 0xFF) out.push_back(0);
+            count -= 8;
+        }
+        buffer &= (1u << count) - 1;
+    }
+
+    // Pads the last byte with 1 bits, as required before a marker
+    void flush() {
+        if (count > 0) put((1u << (8 - count)) - 1, 8 - count);
+    }
+};
+
+// Options for encodeJPEG and saveJPEG
+struct JPEGOptions {
+    int quality = 90;              // 1-100, scales the standard quantization tables
+    int chromaSubsampling = 420;   // 444, 422 or 420
+    bool optimizeHuffman = false;  // second pass with Huffman tables built for this image
+};
+
+// Class to encode baseline JPEG images
+class JPEGEncoder {
+private:
+    // Huffman table as written to DHT plus the derived code for each symbol
+    struct HuffmanCode {
+        unsigned char bits[16] = {};
+        vector<unsigned char> values;
+        unsigned short code[256] = {};
+        unsigned char size[256] = {};
+
+        void build(const unsigned char* counts, const unsigned char* symbols) {
+            memcpy(bits, counts, 16);
+            int total = 0;
+            for (int i = 0; i < 16; i++) total += counts[i];
+            values.assign(symbols, symbols + total);
+            int next = 0, value = 0;
+            for (int length = 1; length <= 16; length++) {
+                for (int i = 0; i < counts[length - 1]; i++) {
+                    code[values[next]] = static_cast<unsigned short>(value++);
+                    size[values[next++]] = static_cast<unsigned char>(length);
+                }
+                value <<= 1;
+            }
+        }
+
+        /**
+         * Builds an optimal table from symbol frequencies (JPEG Annex K.2)
+         *
+         * A dummy symbol with frequency 1 takes the all-ones code, which JPEG forbids;
+         * being the rarest and last, it always receives the last, longest code.
+         */
+        void build(const vector<long long>& frequencies) {
+            vector<long long> withReserved(frequencies);
+            withReserved.resize(257, 0);
+            withReserved[256] = 1;
+            vector<int> lengths = buildCodeLengths(withReserved, 16);
+
+            unsigned char counts[16] = {};
+            vector<unsigned char> symbols;
+            for (int length = 1; length <= 16; length++) {
+                for (int s = 0; s < 256; s++) {
+                    if (lengths[s] == length) {
+                        counts[length - 1]++;
+                        symbols.push_back(static_cast<unsigned char>(s));
+                    }
+                }
+            }
+            build(counts, symbols.data());
+        }
+    };
+
+    int width = 0, height = 0, maxVal = 255;
+    bool color = true;
+    int maxH = 1, maxV = 1, mcusX = 0, mcusY = 0;
+    int blocksPerMCU = 1;
+    unsigned char quant[2][64];
+    float divisors[2][64];      // 1 / (quant * AAN row and column factors * 8)
+    HuffmanCode dcCodes[2], acCodes[2];
+
+    // Bits needed for the magnitude of a coefficient (its JPEG category)
+    static int category(int value) {
+        value = abs(value);
+        int bits = 0;
+        while (value) {
+            bits++;
+            value >>= 1;
+        }
+        return bits;
+    }
+
+    /**
+     * Forward DCT and quantization of one 8 x 8 block of level-shifted samples
+     *
+     * AAN float transform: each pass processes all 8 columns at once so the compiler can
+     * vectorize it; the AAN output scaling is folded into the quantization divisors.
+     * The result is written in zigzag order.
+     */
+    void forwardDCT(float* work, const float* divisor, short* out) const {
+        for (int pass = 0; pass < 2; pass++) {
+            float* w = work;
+            for (int i = 0; i < 8; i++) {
+                float tmp0 = w[i] + w[56 + i], tmp7 = w[i] - w[56 + i];
+                float tmp1 = w[8 + i] + w[48 + i], tmp6 = w[8 + i] - w[48 + i];
+                float tmp2 = w[16 + i] + w[40 + i], tmp5 = w[16 + i] - w[40 + i];
+                float tmp3 = w[24 + i] + w[32 + i], tmp4 = w[24 + i] - w[32 + i];
+
+                float tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+                float tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+                w[i] = tmp10 + tmp11;
+                w[32 + i] = tmp10 - tmp11;
+                float z1 = (tmp12 + tmp13) * 0.707106781f;
+                w[16 + i] = tmp13 + z1;
+                w[48 + i] = tmp13 - z1;
+
+                tmp10 = tmp4 + tmp5;
+                tmp11 = tmp5 + tmp6;
+                tmp12 = tmp6 + tmp7;
+                float z5 = (tmp10 - tmp12) * 0.382683433f;
+                float z2 = 0.541196100f * tmp10 + z5;
+                float z4 = 1.306562965f * tmp12 + z5;
+                float z3 = tmp11 * 0.707106781f;
+                float z11 = tmp7 + z3, z13 = tmp7 - z3;
+                w[40 + i] = z13 + z2;
+                w[24 + i] = z13 - z2;
+                w[8 + i] = z11 + z4;
+                w[56 + i] = z11 - z4;
+            }
+            for (int r = 0; r < 8; r++) {
+                for (int c = r + 1; c < 8; c++) swap(work[r * 8 + c], work[c * 8 + r]);
+            }
+        }
+
+        for (int k = 0; k < 64; k++) {
+            int i = jpegZigzag[k];
+            float v = work[i] * divisor[i];
+            out[k] = static_cast<short>(v >= 0 ? v + 0.5f : v - 0.5f);
+        }
+    }
+
+    /**
+     * Reads one MCU row straight from the image and quantizes its blocks
+     *
+     * Steps:
+     * 1. For each MCU, convert its pixels (edges replicated) to level-shifted Y, Cb, Cr
+     *    in a small local buffer
+     * 2. Luma blocks are copied out; chroma is box-averaged over the subsampling factors
+     * 3. Transform and quantize each block into out, in MCU scan order
+     */
+    void quantizeMCURow(const Image& input, int my, short* out) const {
+        int mcuWidth = 8 * maxH, mcuHeight = 8 * maxV;
+        vector<float> planes[3];
+        for (int c = 0; c < 3; c++) planes[c].resize(static_cast<size_t>(mcuWidth) * mcuHeight);
+        float scale = 255.0f / maxVal;
+        float work[64];
+
+        for (int mx = 0; mx < mcusX; mx++) {
+            for (int y = 0; y < mcuHeight; y++) {
+                int sy = min(height - 1, my * mcuHeight + y);
+                for (int x = 0; x < mcuWidth; x++) {
+                    int sx = min(width - 1, mx * mcuWidth + x);
+                    size_t i = static_cast<size_t>(y) * mcuWidth + x;
+                    if (!color) {
+                        planes[0][i] = max(0, min(maxVal, input(sy, sx, 0))) * scale - 128;
+                        continue;
+                    }
+                    float r = max(0, min(maxVal, input(sy, sx, 0))) * scale;
+                    float g = max(0, min(maxVal, input(sy, sx, 1))) * scale;
+                    float b = max(0, min(maxVal, input(sy, sx, 2))) * scale;
+                    planes[0][i] = 0.299f * r + 0.587f * g + 0.114f * b - 128;
+                    planes[1][i] = -0.168736f * r - 0.331264f * g + 0.5f * b;
+                    planes[2][i] = 0.5f * r - 0.418688f * g - 0.081312f * b;
+                }
+            }
+
+            for (int by = 0; by < maxV; by++) {
+                for (int bx = 0; bx < maxH; bx++) {
+                    for (int y = 0; y < 8; y++) {
+                        for (int x = 0; x < 8; x++) work[y * 8 + x] = planes[0][(by * 8 + y) * mcuWidth + bx * 8 + x];
+                    }
+                    forwardDCT(work, divisors[0], out);
+                    out += 64;
+                }
+            }
+            if (!color) continue;
+
+            float area = 1.0f / (maxH * maxV);
+            for (int c = 1; c < 3; c++) {
+                for (int y = 0; y < 8; y++) {
+                    for (int x = 0; x < 8; x++) {
+                        float sum = 0;
+                        for (int dy = 0; dy < maxV; dy++) {
+                            for (int dx = 0; dx < maxH; dx++) sum += planes[c][(y * maxV + dy) * mcuWidth + x * maxH + dx];
+                        }
+                        work[y * 8 + x] = sum * area;
+                    }
+                }
+                forwardDCT(work, divisors[1], out);
+                out += 64;
+            }
+        }
+    }
+
+    // Walks the Huffman symbols of one block: emit(table, symbol, extra bits, extra length)
+    template <typename Emit>
+    static void walkBlock(const short* block, int& predictor, int table, Emit emit) {
+        int diff = block[0] - predictor;
+        predictor = block[0];
+        int bits = category(diff);
+        emit(table, 0, bits, diff < 0 ? diff - 1 : diff, bits);
+
+        int run = 0;
+        for (int k = 1; k < 64; k++) {
+            if (block[k] == 0) {
+                run++;
+                continue;
+            }
+            while (run > 15) {
+                emit(table, 1, 0xF0, 0, 0);
+                run -= 16;
+            }
+            int value = block[k];
+            bits = category(value);
+            emit(table, 1, run << 4 | bits, value < 0 ? value - 1 : value, bits);
+            run = 0;
+        }
+        if (run > 0) emit(table, 1, 0x00, 0, 0);
+    }
+
+    // Table (0 luma, 1 chroma) and scan component of each block in an MCU
+    int blockTable(int b) const { return b < maxH * maxV ? 0 : 1; }
+    int blockComponent(int b) const { return b < maxH * maxV ? 0 : b - maxH * maxV + 1; }
+
+    void encodeMCURow(const short* blocks, vector<unsigned char>& out) const {
+        JPEGBitWriter writer(out);
+        int predictors[3] = {};
+        for (int mx = 0; mx < mcusX; mx++) {
+            for (int b = 0; b < blocksPerMCU; b++, blocks += 64) {
+                walkBlock(blocks, predictors[blockComponent(b)], blockTable(b),
+                    [&](int table, int ac, int symbol, int extra, int extraLength) {
+                        const HuffmanCode& code = ac ? acCodes[table] : dcCodes[table];
+                        writer.put(code.code[symbol], code.size[symbol]);
+                        if (extraLength > 0) writer.put(static_cast<uint32_t>(extra), extraLength);
+                    });
+            }
+        }
+        writer.flush();
+    }
+
+    void writeMarker(vector<unsigned char>& out, int marker, const vector<unsigned char>& body) const {
+        out.push_back(0xFF);
+        out.push_back(static_cast<unsigned char>(marker));
+        out.push_back(static_cast<unsigned char>((body.size() + 2) >> 8));
+        out.push_back(static_cast<unsigned char>(body.size() + 2));
+        out.insert(out.end(), body.begin(), body.end());
+    }
+
+    void writeHuffmanTable(vector<unsigned char>& out, int classAndIndex, const HuffmanCode& code) const {
+        vector<unsigned char> body = { static_cast<unsigned char>(classAndIndex) };
+        body.insert(body.end(), code.bits, code.bits + 16);
+        body.insert(body.end(), code.values.begin(), code.values.end());
+        writeMarker(out, 0xC4, body);
+    }
+
+public:
+    /**
+     * Encodes an image as a baseline JPEG
+     *
+     * Steps:
+     * 1. Scale the standard quantization tables for the quality and fold in the AAN factors
+     * 2. Each MCU row is a restart interval, so rows are quantized and entropy coded
+     *    on separate threads and joined with RSTn markers
+     * 3. With optimizeHuffman, all rows are quantized first, symbol statistics gathered
+     *    and image-specific Huffman tables built before entropy coding
+     * 4. Write SOI, APP0 (JFIF), DQT, SOF0, DHT, DRI, SOS, the data and EOI
+     */
+    vector<unsigned char> encode(const Image& input, const JPEGOptions& options = JPEGOptions()) {
+        width = input.getWidth();
+        height = input.getHeight();
+        maxVal = max(1, input.getMaxVal());
+        color = input.getChannels() >= 3;
+        if (width <= 0 || height <= 0 || width > 65535 || height > 65535) {
+            cerr << "Error: Image size not supported by JPEG" << endl;
+            return vector<unsigned char>();
+        }
+
+        maxH = color && options.chromaSubsampling != 444 ? 2 : 1;
+        maxV = color && options.chromaSubsampling == 420 ? 2 : 1;
+        blocksPerMCU = maxH * maxV + (color ? 2 : 0);
+        mcusX = (width + 8 * maxH - 1) / (8 * maxH);
+        mcusY = (height + 8 * maxV - 1) / (8 * maxV);
+
+        int quality = max(1, min(100, options.quality));
+        int scaling = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+        for (int i = 0; i < 64; i++) {
+            quant[0][i] = static_cast<unsigned char>(max(1, min(255, (jpegLumaQuant[i] * scaling + 50) / 100)));
+            quant[1][i] = static_cast<unsigned char>(max(1, min(255, (jpegChromaQuant[i] * scaling + 50) / 100)));
+            for (int t = 0; t < 2; t++) {
+                divisors[t][i] = 1.0f / (quant[t][i] * aanScaleFactor(i >> 3) * aanScaleFactor(i & 7) * 8.0f);
+            }
+        }
+        dcCodes[0].build(jpegLumaDCBits, jpegDCValues);
+        dcCodes[1].build(jpegChromaDCBits, jpegDCValues);
+        acCodes[0].build(jpegLumaACBits, jpegLumaACValues);
+        acCodes[1].build(jpegChromaACBits, jpegChromaACValues);
+
+        size_t rowCoefficients = static_cast<size_t>(mcusX) * blocksPerMCU * 64;
+        vector<vector<unsigned char>> segments(mcusY);
+
+        if (options.optimizeHuffman) {
+            vector<short> coefficients(rowCoefficients * mcusY);
+            vector<vector<long long>> frequencies(4, vector<long long>(256, 0)); // DC luma, DC chroma, AC luma, AC chroma
+            mutex frequencyMutex;
+            parallelFor(0, mcusY, [&](int y0, int y1) {
+                vector<vector<long long>> local(4, vector<long long>(256, 0));
+                for (int my = y0; my < y1; my++) {
+                    const short* blocks = &coefficients[rowCoefficients * my];
+                    quantizeMCURow(input, my, &coefficients[rowCoefficients * my]);
+                    int predictors[3] = {};
+                    for (int mx = 0; mx < mcusX; mx++) {
+                        for (int b = 0; b < blocksPerMCU; b++, blocks += 64) {
+                            walkBlock(blocks, predictors[blockComponent(b)], blockTable(b),
+                                [&](int table, int ac, int symbol, int, int) { local[ac * 2 + table][symbol]++; });
+                        }
+                    }
+                }
+                lock_guard<mutex> lock(frequencyMutex);
+                for (int t = 0; t < 4; t++) {
+                    for (int s = 0; s < 256; s++) frequencies[t][s] += local[t][s];
+                }
+            }, 1);
+
+            for (int t = 0; t < 2; t++) {
+                dcCodes[t].build(frequencies[t]);
+                acCodes[t].build(frequencies[2 + t]);
+            }
+            parallelFor(0, mcusY, [&](int y0, int y1) {
+                for (int my = y0; my < y1; my++) encodeMCURow(&coefficients[rowCoefficients * my], segments[my]);
+            }, 1);
+        }
+        else {
+            parallelFor(0, mcusY, [&](int y0, int y1) {
+                vector<short> blocks(rowCoefficients);
+                for (int my = y0; my < y1; my++) {
+                    quantizeMCURow(input, my, blocks.data());
+                    encodeMCURow(blocks.data(), segments[my]);
+                }
+            }, 1);
+        }
+
+        vector<unsigned char> out = { 0xFF, 0xD8 };
+        writeMarker(out, 0xE0, { 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0 });
+        for (int t = 0; t < (color ? 2 : 1); t++) {
+            vector<unsigned char> body = { static_cast<unsigned char>(t) };
+            for (int k = 0; k < 64; k++) body.push_back(quant[t][jpegZigzag[k]]);
+            writeMarker(out, 0xDB, body);
+        }
+
+        vector<unsigned char> frame = {
+            8, static_cast<unsigned char>(height >> 8), static_cast<unsigned char>(height),
+            static_cast<unsigned char>(width >> 8), static_cast<unsigned char>(width),
+            static_cast<unsigned char>(color ? 3 : 1),
+            1, static_cast<unsigned char>(maxH << 4 | maxV), 0
+        };
+        if (color) frame.insert(frame.end(), { 2, 0x11, 1, 3, 0x11, 1 });
+        writeMarker(out, 0xC0, frame);
+
+        for (int t = 0; t < (color ? 2 : 1); t++) {
+            writeHuffmanTable(out, t, dcCodes[t]);
+            writeHuffmanTable(out, 0x10 | t, acCodes[t]);
+        }
+        writeMarker(out, 0xDD, { static_cast<unsigned char>(mcusX >> 8), static_cast<unsigned char>(mcusX) });
+
+        vector<unsigned char> scan = { static_cast<unsigned char>(color ? 3 : 1), 1, 0x00 };
+        if (color) scan.insert(scan.end(), { 2, 0x11, 3, 0x11 });
+        scan.insert(scan.end(), { 0, 63, 0 });
+        writeMarker(out, 0xDA, scan);
+
+        for (int my = 0; my < mcusY; my++) {
+            if (my > 0) {
+                out.push_back(0xFF);
+                out.push_back(static_cast<unsigned char>(0xD0 + (my - 1) % 8));
+            }
+            out.insert(out.end(), segments[my].begin(), segments[my].end());
+        }
+        out.push_back(0xFF);
+        out.push_back(0xD9);
+        return out;
+    }
+};
+
+// Encodes an image as JPEG data
+vector<unsigned char> encodeJPEG(const Image& input, const JPEGOptions& options = JPEGOptions()) {
+    JPEGEncoder encoder;
+    return encoder.encode(input, options);
+}
+
+// Saves an image as a JPEG file
+bool saveJPEG(const Image& img, const string& filename, const JPEGOptions& options = JPEGOptions()) {
+    vector<unsigned char> data = encodeJPEG(img, options);
+    if (data.empty()) return false;
+    ofstream file(filename, ios::binary);
+    if (!file.is_open()) {
+        cerr << "Error: Could not create file " << filename << endl;
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(data.data()), data.size());
+    file.close();
+    return true;
+}
+
+// Options for loadImage
+struct LoadOptions {
+    int scale = 1;          // 1, 2, 4 or 8: load at 1/scale of the stored size (rounded up)
+    bool skipRows = false;  // PPM: read one row per output row and only average horizontally
+};
+
+/**
+ * Shrinks an image by an integer factor with box averaging
+ *
+ * Steps:
+ * 1. The output is ceil(width / factor) x ceil(height / factor)
+ * 2. Each output pixel is the rounded mean of its factor x factor cell; cells on the
+ *    right and bottom edges average only the pixels that exist
+ * 3. Output rows are processed in parallel; output keeps its storage when it
+ *    already has the reduced shape
+ */
+void reduceImage(const Image& input, int factor, Image& output) {
+    int width = input.getWidth();
+    int height = input.getHeight();
+    int channels = input.getChannels();
+    factor = max(1, factor);
+    int outWidth = (width + factor - 1) / factor;
+    int outHeight = (height + factor - 1) / factor;
+    reshapeImage(output, outWidth, outHeight, channels, input.getMaxVal());
+
+    parallelFor(0, outHeight, [&](int y0, int y1) {
+        for (int oy = y0; oy < y1; oy++) {
+            int top = oy * factor, bottom = min(height, top + factor);
+            for (int ox = 0; ox < outWidth; ox++) {
+                int left = ox * factor, right = min(width, left + factor);
+                int count = (bottom - top) * (right - left);
+                for (int c = 0; c < channels; c++) {
+                    long long sum = 0;
+                    for (int y = top; y < bottom; y++) {
+                        for (int x = left; x < right; x++) sum += input(y, x, c);
+                    }
+                    output(oy, ox, c) = static_cast<int>((sum + count / 2) / count);
+                }
+            }
+        }
+    });
+}
+
+// Shrinks an image by an integer factor, returning a new image
+Image reduceImage(const Image& input, int factor) {
+    Image output;
+    reduceImage(input, factor, output);
+    return output;
+}
+
+/**
+ * Loads a P3 or P6 PPM file at 1/scale resolution without holding the full image
+ *
+ * Steps:
+ * 1. Stream the file with PPMRowReader; only the output (reused if img already has its
+ *    shape) and one row of sums are allocated
+ * 2. For each output row, accumulate the scale input rows of its band column-cell by
+ *    column-cell and write their rounded means
+ * 3. With skipRows, read just the middle row of each band and skip the rest
+ *    (a seek for P6), averaging horizontally only
+ */
+bool loadPPMScaled(Image& img, const string& filename, int scale, bool skipRows = false) {
+    PPMRowReader reader;
+    if (!reader.open(filename)) return false;
+    int width = reader.getWidth();
+    int height = reader.getHeight();
+    if (width <= 0 || height <= 0) {
+        cerr << "Error: Invalid PPM dimensions in " << filename << endl;
+        return false;
+    }
+
+    scale = max(1, scale);
+    int outWidth = (width + scale - 1) / scale;
+    int outHeight = (height + scale - 1) / scale;
+    reshapeImage(img, outWidth, outHeight, 3, reader.getMaxVal());
+
+    vector<int> row;
+    vector<long long> sums(static_cast<size_t>(outWidth) * 3);
+    for (int oy = 0; oy < outHeight; oy++) {
+        int top = oy * scale, bottom = min(height, top + scale);
+        int sampled = skipRows ? top + (bottom - top) / 2 : -1;
+        fill(sums.begin(), sums.end(), 0);
+
+        for (int y = top; y < bottom; y++) {
+            bool ok = skipRows && y != sampled ? reader.skipRow() : reader.readRow(row);
+            if (!ok) {
+                cerr << "Error: Unexpected end of file in " << filename << endl;
+                return false;
+            }
+            if (skipRows && y != sampled) continue;
+            for (int x = 0; x < width; x++) {
+                long long* cell = &sums[static_cast<size_t>(x / scale) * 3];
+                for (int c = 0; c < 3; c++) cell[c] += row[x * 3 + c];
+            }
+        }
+
+        int rows = skipRows ? 1 : bottom - top;
+        for (int ox = 0; ox < outWidth; ox++) {
+            int count = rows * (min(width, (ox + 1) * scale) - ox * scale);
+            for (int c = 0; c < 3; c++) {
+                img(oy, ox, c) = static_cast<int>((sums[ox * 3 + c] + count / 2) / count);
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Loads an image of any supported format, optionally at reduced resolution
+ *
+ * Steps:
+ * 1. Identify the format from the first bytes of the file
+ * 2. JPEG decodes directly at the requested scale (DCT scaling) and PPM (P3/P6)
+ *    streams rows into a reduced image, so neither allocates the full-size image
+ * 3. PNG, QOI, tiled and PAM files are decoded in full (into scratch when scale > 1)
+ *    and then box-reduced into img, whose storage is kept when the shape matches
+ *
+ * On failure the contents of img (and scratch) are unspecified: decoders write
+ * into them as they go, so callers must not use a buffer whose load failed.
+ */
+bool loadImage(Image& img, const string& filename, const LoadOptions& options, Image& scratch) {
+    int scale = options.scale;
+    if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+        cerr << "Error: Load scale must be 1, 2, 4 or 8" << endl;
+        return false;
+    }
+
+    ifstream file(filename, ios::binary);
+    if (!file.is_open()) {
+        cerr << "Error: Could not open file " << filename << endl;
+        return false;
+    }
+    unsigned char magic[4] = {};
+    file.read(reinterpret_cast<char*>(magic), 4);
+    file.close();
+
+    if (magic[0] == 0xFF && magic[1] == 0xD8) return loadJPEG(img, filename, scale);
+    if (magic[0] == 'P' && (magic[1] == '3' || magic[1] == '6')) return loadPPMScaled(img, filename, scale, options.skipRows);
+
+    Image& full = scale > 1 ? scratch : img;
+    bool loaded;
+    if (memcmp(magic, "\x89PNG", 4) == 0) loaded = loadPNG(full, filename);
+    else if (memcmp(magic, "qoif", 4) == 0) loaded = loadQOI(full, filename);
+    else if (memcmp(magic, "TQOI", 4) == 0) loaded = loadTiled(full, filename);
+    else if (magic[0] == 'P' && magic[1] == '7') loaded = full.loadPAM(filename);
+    else {
+        cerr << "Error: Unrecognized image format in " << filename << endl;
+        return false;
+    }
+    if (loaded && scale > 1) reduceImage(full, scale, img);
+    return loaded;
+}
+
+// Loads an image of any supported format, using a temporary buffer for full-size decodes
+bool loadImage(Image& img, const string& filename, const LoadOptions& options = LoadOptions()) {
+    Image scratch;
+    return loadImage(img, filename, options, scratch);
+}
+
+// Class to run the same processing over a sequence of same-size frames
+// Two frame buffers are allocated once and alternated; the decoders reuse their storage
+class FrameSequence {
+private:
+    vector<string> files;
+    LoadOptions options;
+    Image buffers[2];
+    Image scratch;  // full-size decode before reduction (only one load runs at a time)
+
+public:
+    explicit FrameSequence(const vector<string>& frameFiles, const LoadOptions& loadOptions = LoadOptions())
+        : files(frameFiles), options(loadOptions) {}
+
+    int size() const { return static_cast<int>(files.size()); }
+
+    /**
+     * Calls process(frame, index) for every frame in order
+     *
+     * Steps:
+     * 1. Load frame 0 into the first buffer
+     * 2. For each frame N: load frame N + 1 into the other buffer on a background thread
+     *    while process runs on frame N, then wait for the load
+     * 3. Stop at the first frame that fails to load or differs in size from frame 0;
+     *    a buffer whose load failed holds partial data and is never passed to process
+     * 4. Return the number of frames processed
+     *
+     * The frame passed to process is only valid during the call; copy it to keep it.
+     * If process throws, the pending load is joined before the exception propagates.
+     */
+    int forEach(const function<void(const Image& frame, int index)>& process) {
+        if (files.empty() || !loadImage(buffers[0], files[0], options, scratch)) return 0;
+        int width = buffers[0].getWidth(), height = buffers[0].getHeight();
+
+        int processed = 0;
+        for (int i = 0; i < size(); i++) {
+            Image& current = buffers[i % 2];
+            Image& next = buffers[(i + 1) % 2];
+            bool nextLoaded = false;
+            thread loader;
+            // Joins the loader on every exit, so an exception from process cannot leave it running
+            struct JoinOnExit {
+                thread& worker;
+                ~JoinOnExit() { if (worker.joinable()) worker.join(); }
+            } joinOnExit{ loader };
+            if (i + 1 < size()) {
+                loader = thread([&, i]() { nextLoaded = loadImage(next, files[i + 1], options, scratch); });
+            }
+
+            process(current, i);
+            processed++;
+
+            if (!loader.joinable()) break;
+            loader.join();
+            if (!nextLoaded) break;
+            if (next.getWidth() != width || next.getHeight() != height) {
+                cerr << "Error: Frame " << files[i + 1] << " differs in size from the first frame" << endl;
+                break;
+            }
+        }
+        return processed;
+    }
+};
+
+// Class to hold the most recent frames of a sequence in a ring buffer for temporal filters
+// A running per-sample sum makes the window average cost the same for any window size
+class FrameWindow {
+private:
+    int capacity, count, next;
+    vector<Image> frames;
+    vector<long long> sums;  // [(y * width + x) * channels + c] over the frames in the window
+    int width, height, channels, maxVal;
+
+public:
+    explicit FrameWindow(int size) {
+        capacity = max(1, size);
+        count = 0;
+        next = 0;
+        frames.resize(capacity);
+        width = 0;
+        height = 0;
+        channels = 0;
+        maxVal = 255;
+    }
+
+    int getCount() const { return count; }
+    bool isFull() const { return count == capacity; }
+
+    // Frame pushed age pushes ago (0 = the latest)
+    const Image& frame(int age) const { return frames[((next - 1 - age) % capacity + capacity) % capacity]; }
+
+    /**
+     * Adds a frame, evicting the oldest once the window is full
+     *
+     * Steps:
+     * 1. On a size change, reset the window
+     * 2. Subtract the evicted frame from the running sums and add the new one
+     *    (rows in parallel)
+     * 3. Copy the frame into its ring slot, reusing the slot's storage
+     */
+    void push(const Image& input) {
+        if (input.getWidth() != width || input.getHeight() != height || input.getChannels() != channels) {
+            width = input.getWidth();
+            height = input.getHeight();
+            channels = input.getChannels();
+            count = 0;
+            next = 0;
+            sums.assign(static_cast<size_t>(width) * height * channels, 0);
+        }
+        maxVal = input.getMaxVal();
+
+        bool evict = count == capacity;
+        const Image& oldest = frames[next];
+        parallelFor(0, height, [&](int y0, int y1) {
+            for (int y = y0; y < y1; y++) {
+                long long* sum = &sums[static_cast<size_t>(y) * width * channels];
+                for (int x = 0; x < width; x++) {
+                    for (int c = 0; c < channels; c++) {
+                        *sum += input(y, x, c) - (evict ? oldest(y, x, c) : 0);
+                        sum++;
+                    }
+                }
+            }
+        });
+
+        frames[next] = input;
+        next = (next + 1) % capacity;
+        if (!evict) count++;
+    }
+
+    // Writes the mean of the frames in the window into output (storage reused when possible)
+    void average(Image& output) const {
+        reshapeImage(output, width, height, channels, maxVal);
+        if (count == 0) return;
+        parallelFor(0, height, [&](int y0, int y1) {
+            for (int y = y0; y < y1; y++) {
+                const long long* sum = &sums[static_cast<size_t>(y) * width * channels];
+                for (int x = 0; x < width; x++) {
+                    for (int c = 0; c < channels; c++) {
+                        output(y, x, c) = static_cast<int>((*sum++ + count / 2) / count);
+                    }
+                }
+            }
+        });
+    }
+
+    Image average() const {
+        Image output;
+        average(output);
+        return output;
+    }
+};
+
+/**
+ * Computes the absolute per-sample difference of two frames
+ *
+ * Steps:
+ * 1. Shape output like the current frame (storage reused when it already matches)
+ * 2. For each sample (rows in parallel), store |current - previous|
+ *    (frames of different sizes are compared over their common area)
+ */
+void frameDifference(const Image& current, const Image& previous, Image& output) {
+    int width = current.getWidth();
+    int height = current.getHeight();
+    int channels = current.getChannels();
+    reshapeImage(output, width, height, channels, current.getMaxVal());
+    int commonWidth = min(width, previous.getWidth());
+    int commonHeight = min(height, previous.getHeight());
+    int commonChannels = min(channels, previous.getChannels());
+
+    parallelFor(0, height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < channels; c++) {
+                    bool inside = y < commonHeight && x < commonWidth && c < commonChannels;
+                    output(y, x, c) = inside ? abs(current(y, x, c) - previous(y, x, c)) : current(y, x, c);
+                }
+            }
+        }
+    });
+}
+
+Image frameDifference(const Image& current, const Image& previous) {
+    Image output;
+    frameDifference(current, previous, output);
+    return output;
+}
+
+
+// Creates a simple 4x4 test image with a pattern
+void createTestImage(const string& filename) {
+    Image img(4, 4);
+
+    // Create a simple 4x4 pattern
+    // Row 0
+    img(0, 0, 0) = 255; img(0, 0, 1) = 0;   img(0, 0, 2) = 0;    // Red
+    img(0, 1, 0) = 0;   img(0, 1, 1) = 255; img(0, 1, 2) = 0;    // Green
+    img(0, 2, 0) = 0;   img(0, 2, 1) = 0;   img(0, 2, 2) = 255;  // Blue
+    img(0, 3, 0) = 255; img(0, 3, 1) = 255; img(0, 3, 2) = 255;  // White
+
+    // Row 1
+    img(1, 0, 0) = 255; img(1, 0, 1) = 255; img(1, 0, 2) = 0;    // Yellow
+    img(1, 1, 0) = 255; img(1, 1, 1) = 0;   img(1, 1, 2) = 255;  // Magenta
+    img(1, 2, 0) = 0;   img(1, 2, 1) = 255; img(1, 2, 2) = 255;  // Cyan
+    img(1, 3, 0) = 128; img(1, 3, 1) = 128; img(1, 3, 2) = 128;  // Gray
+
+    // Row 2
+    img(2, 0, 0) = 255; img(2, 0, 1) = 128; img(2, 0, 2) = 0;    // Orange
+    img(2, 1, 0) = 128; img(2, 1, 1) = 255; img(2, 1, 2) = 0;    // Light Green
+    img(2, 2, 0) = 128; img(2, 2, 1) = 0;   img(2, 2, 2) = 255;  // Purple
+    img(2, 3, 0) = 255; img(2, 3, 1) = 128; img(2, 3, 2) = 128;  // Pink
+
+    // Row 3
+    img(3, 0, 0) = 128; img(3, 0, 1) = 255; img(3, 0, 2) = 128;  // Light Green
+    img(3, 1, 0) = 128; img(3, 1, 1) = 128; img(3, 1, 2) = 255;  // Light Blue
+    img(3, 2, 0) = 255; img(3, 2, 1) = 255; img(3, 2, 2) = 128;  // Light Yellow
+    img(3, 3, 0) = 0;   img(3, 3, 1) = 0;   img(3, 3, 2) = 0;    // Black
+
+    img.savePPM("outbut.ppm");
+    cout << "Created 4x4 test image:outbut.ppm " << endl;
+
+    // Print the image data to console
+    cout << "\nOriginal image data:\n";
+    img.print();
+}
+
+int main() {
+
+    cout << "Image Processing with Matrices - Student Project\n";
+    cout << "================================================\n\n";
+
+    // Create a 4x4 test image
+    createTestImage("test_image.ppm");
+
+    // Load the image
+    Image input;
+    if (!input.loadPPM("test_image.ppm")) {
+        cerr << "Failed to load image. Exiting.\n";
+        return 1;
+    }
+
+    cout << "\nImage loaded successfully. Dimensions: "
+        << input.getWidth() << "x" << input.getHeight() << "\n\n";
+
+    // Apply various transformations
+    cout << "Applying image transformations...\n";
+
+    Image gray = convertToGrayscale(input);
+    gray.savePPM("gray_image.ppm");
+    cout << "- Grayscale conversion completed\n";
+    cout << "Grayscale image data:\n";
+    gray.print();
+    cout << endl;
+
+    Image flippedH = flipHorizontal(input);
+    flippedH.savePPM("flipped_horizontal.ppm");
+    cout << "- Horizontal flip completed\n";
+    cout << "Horizontally flipped image data:\n";
+    flippedH.print();
+    cout << endl;
+
+    Image flippedV = flipVertical(input);
+    flippedV.savePPM("flipped_vertical.ppm");
+    cout << "- Vertical flip completed\n";
+    cout << "Vertically flipped image data:\n";
+    flippedV.print();
+    cout << endl;
+
+    Image bright = adjustBrightness(input, 50);
+    bright.savePPM("bright_image.ppm");
+    cout << "- Brightness adjustment completed\n";
+    cout << "Brightness adjusted image data:\n";
+    bright.print();
+    cout << endl;
+
+    Image contrast = adjustContrast(input, 1.5f);
+    contrast.savePPM("contrast_image.ppm");
+    cout << "- Contrast adjustment completed\n";
+    cout << "Contrast adjusted image data:\n";
+    contrast.print();
+    cout << endl;
+
+    Image blur = applyBlur(input);
+    blur.savePPM("blurred_image.ppm");
+    cout << "- Blur filter completed\n";
+    cout << "Blurred image data:\n";
+    blur.print();
+    cout << endl;
+
+    Image rotated = rotate90Clockwise(input);
+    rotated.savePPM("rotated90_image.ppm");
+    cout << "- 90-degree rotation completed\n";
+    cout << "Rotated image data:\n";
+    rotated.print();
+    cout << endl;
+
+    Image edges = detectEdgesCanny(input, 100.0f, 200.0f);
+    edges.savePPM("edges_image.ppm");
+    cout << "- Canny edge detection completed\n";
+    cout << "Edge image data:\n";
+    edges.print();
+    cout << endl;
+
+    vector<long long> lumaHistogram = computeLuminanceHistogram(input);
+    cout << "- Luminance histogram completed\n";
+    cout << "Non-empty luminance bins:\n";
+    for (int v = 0; v < static_cast<int>(lumaHistogram.size()); v++) {
+        if (lumaHistogram[v] > 0) cout << v << ": " << lumaHistogram[v] << "\n";
+    }
+    cout << endl;
+
+    Image equalized = equalizeHistogram(input);
+    equalized.savePPM("equalized_image.ppm");
+    cout << "- Histogram equalization completed\n";
+    cout << "Equalized image data:\n";
+    equalized.print();
+    cout << endl;
+
+    int otsu = computeOtsuThreshold(input);
+    Image binary = maskToImage(thresholdOtsu(input));
+    binary.savePPM("otsu_image.ppm");
+    cout << "- Otsu thresholding completed (threshold " << otsu << ")\n";
+    cout << "Binary image data:\n";
+    binary.print();
+    cout << endl;
+
+    LabelResult components = labelComponents(thresholdOtsu(input));
+    cout << "- Connected-component labelling completed (" << components.components.size() << " components)\n";
+    for (size_t k = 0; k < components.components.size(); k++) {
+        const ComponentStats& s = components.components[k];
+        cout << "Component " << k + 1 << ": area " << s.area
+            << ", bbox (" << s.minX << "," << s.minY << ")-(" << s.maxX << "," << s.maxY << ")"
+            << ", centroid (" << s.centroidX << "," << s.centroidY << ")\n";
+    }
+    cout << endl;
+
+    Image saturated = adjustHueSaturation(input, 30, 0.5f);
+    saturated.savePPM("hue_saturation_image.ppm");
+    cout << "- Hue/saturation adjustment completed\n";
+    cout << "Hue/saturation adjusted image data:\n";
+    saturated.print();
+    cout << endl;
+
+    Image linearBlur = convertToSRGB(applyBlur(convertToLinear(input)));
+    linearBlur.savePPM("linear_blurred_image.ppm");
+    cout << "- Linear-light blur completed\n";
+    cout << "Linear-light blurred image data:\n";
+    linearBlur.print();
+    cout << endl;
+
+    Image sharpened = applyUnsharpMask(input, 1.0f, 0.5f, 0);
+    sharpened.savePPM("sharpened_image.ppm");
+    cout << "- Unsharp mask completed\n";
+    cout << "Sharpened image data:\n";
+    sharpened.print();
     cout << endl;
 
     cout << "\nAll operations completed successfully!\n";